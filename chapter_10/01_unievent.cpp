@@ -13,8 +13,9 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "signal_source.h"
+
 #define MAX_EVENT_NUMBER 1024
-static int pipefd[2];
 
 int setnonblocking(int fd) {
     int old_option = fcntl(fd, F_GETFL);
@@ -31,22 +32,6 @@ void addfd(int epollfd, int fd) {
     setnonblocking(fd);
 }
 
-void sig_handler(int sig) {
-    int save_errno = errno;
-    int msg = sig;
-    send(pipefd[1], (char *)&msg, 1, 0);
-    errno = save_errno;
-}
-
-void addsig(int sig) {
-    struct sigaction sa;
-    memset(&sa, '\0', sizeof(sa));
-    sa.sa_handler = sig_handler;
-    sa.sa_flags |= SA_RESTART;
-    sigfillset(&sa.sa_mask);
-    assert(sigaction(sig, &sa, NULL) != -1);
-}
-
 int main(int argc, char *argv[]) {
     if (argc <= 2) {
         printf("usage: %s ip_address port_number\n", basename(argv[0]));
@@ -69,7 +54,8 @@ int main(int argc, char *argv[]) {
         printf("errno is %d\n", errno);
         return 1;
     }
-    ret = listen(listenfd, 5);
+    // the kernel caps this at net.core.somaxconn
+    ret = listen(listenfd, SOMAXCONN);
     assert(ret != -1);
 
     epoll_event events[MAX_EVENT_NUMBER];
@@ -77,15 +63,12 @@ int main(int argc, char *argv[]) {
     assert(epollfd != -1);
     addfd(epollfd, listenfd);
 
-    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, pipefd);
-    assert(ret != -1);
-    setnonblocking(pipefd[1]);
-    addfd(epollfd, pipefd[0]);
-
-    addsig(SIGHUP);
-    addsig(SIGCHLD);
-    addsig(SIGTERM);
-    addsig(SIGINT);
+    signal_source signals;
+    signals.add(SIGHUP);
+    signals.add(SIGCHLD);
+    signals.add(SIGTERM);
+    signals.add(SIGINT);
+    addfd(epollfd, signals.fd());
     bool stop_server = false;
 
     while (!stop_server) {
@@ -98,29 +81,39 @@ int main(int argc, char *argv[]) {
         for (int i = 0; i < number; i++) {
             int sockfd = events[i].data.fd;
             if (sockfd == listenfd) {
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof(client_address);
-                int connfd =
-                    accept(listenfd, (struct sockaddr *)&client_address,
-                           &client_addrlength);
-                addfd(epollfd, connfd);
-            } else if ((sockfd == pipefd[0]) && (events[i].events & EPOLLIN)) {
-                int sig;
-                char signals[1024];
-                ret = recv(pipefd[0], signals, sizeof(signals), 0);
-                if (ret == -1) {
-                    continue;
-                } else if (ret == 0) {
-                    continue;
-                } else {
-                    for (int i = 0; i < ret; ++i) {
-                        switch (signals[i]) {
+                // edge triggered: accept until the queue is empty
+                while (true) {
+                    struct sockaddr_in client_address;
+                    socklen_t client_addrlength = sizeof(client_address);
+                    int connfd = accept4(
+                        listenfd, (struct sockaddr *)&client_address,
+                        &client_addrlength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (connfd < 0) {
+                        if ((errno == ECONNABORTED) || (errno == EINTR)) {
+                            continue;
+                        }
+                        if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                            printf("errno is: %d\n", errno);
+                        }
+                        break;
+                    }
+                    addfd(epollfd, connfd);
+                }
+            } else if ((sockfd == signals.fd()) &&
+                       (events[i].events & EPOLLIN)) {
+                // edge triggered: read until nothing is pending
+                while (signals.read_batch() > 0) {
+                    for (int j = 0; j < signals.count(); ++j) {
+                        const signalfd_siginfo &si = signals.info(j);
+                        switch (si.ssi_signo) {
                             case SIGCHLD:
                             case SIGHUP: {
                                 continue;
                             }
                             case SIGTERM:
                             case SIGINT: {
+                                printf("signal %d from pid %d\n", si.ssi_signo,
+                                       si.ssi_pid);
                                 stop_server = true;
                             }
                         }
@@ -132,7 +125,5 @@ int main(int argc, char *argv[]) {
   
     printf("close fds\n");
     close(listenfd);
-    close(pipefd[1]);
-    close(pipefd[0]);
     return 0;
 }
@@ -3,43 +3,93 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
-#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include "event_loop.h"
+
 #define BUF_SIZE 1024
+#define MAX_FD 65536
+#define MAX_EVENT_NUMBER 1024
 
-static int connfd;
+// Urgent data without SIGURG. F_SETOWN gives one owner per socket and runs
+// recv(MSG_OOB) in signal context; here every connection asks for EPOLLPRI
+// and the urgent byte is read in the loop, on any number of sockets.
+// event_loop hands EPOLLPRI out ahead of the normal data of the round.
+struct connection;
+typedef void (*oob_callback)(connection* conn, char byte);
 
-void sig_urg(int sig) {
-    int save_errno = errno;
+struct connection {
+    int fd;
+    // dropping in-band data until the read pointer reaches the urgent mark
+    bool discarding;
+    oob_callback on_oob;
+};
 
-    char buffer[BUF_SIZE];
-    memset(buffer, '\0', BUF_SIZE);
-    int ret = recv(connfd, buffer, BUF_SIZE - 1, MSG_OOB);
-    printf("got %d bytes of oob data '%s'\n", ret, buffer);
+static connection* conns = NULL;
+
+int setnonblocking(int fd) {
+    int old_option = fcntl(fd, F_GETFL);
+    int new_option = old_option | O_NONBLOCK;
+    fcntl(fd, F_SETFL, new_option);
+    return old_option;
+}
 
-    errno = save_errno;
+// telnet-style sync: whatever was sent before the urgent byte is stale
+void flush_to_mark(connection* conn, char byte) {
+    printf("got 1 bytes of oob data '%c' on fd %d\n", byte, conn->fd);
+    conn->discarding = true;
 }
 
-void addsig(int sig, void (*sig_handler)(int)) {
-    struct sigaction sa;
-    memset(&sa, '\0', sizeof(sa));
-    sa.sa_handler = sig_handler;
-    sa.sa_flags |= SA_RESTART;
-    sigfillset(&sa.sa_mask);
-    assert(sigaction(sig, &sa, NULL) != -1);
+void read_urgent(connection* conn) {
+    char byte;
+    int ret = recv(conn->fd, &byte, 1, MSG_OOB);
+    if (ret == 1) {
+        if (conn->on_oob) {
+            conn->on_oob(conn, byte);
+        }
+        return;
+    }
+    // EAGAIN: the urgent pointer came ahead of the byte, EPOLLPRI fires
+    // again when it lands. EINVAL: a newer urgent byte replaced it.
+    if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINVAL)) {
+        printf("errno is: %d\n", errno);
+    }
 }
 
-int main(int argc, char *argv[]) {
+// false once the peer is gone; recv() never reads across the urgent mark
+bool read_normal(connection* conn) {
+    char buffer[BUF_SIZE];
+    while (true) {
+        if (conn->discarding && (sockatmark(conn->fd) == 1)) {
+            printf("reached the urgent mark on fd %d\n", conn->fd);
+            conn->discarding = false;
+        }
+        int ret = recv(conn->fd, buffer, BUF_SIZE - 1, 0);
+        if (ret < 0) {
+            return (errno == EAGAIN) || (errno == EWOULDBLOCK);
+        } else if (ret == 0) {
+            return false;
+        }
+        if (conn->discarding) {
+            printf("dropped %d bytes of normal data\n", ret);
+            continue;
+        }
+        buffer[ret] = '\0';
+        printf("got %d bytes of normal data '%s'\n", ret, buffer);
+    }
+}
+
+int main(int argc, char* argv[]) {
     if (argc <= 2) {
         printf("usage: %s ip_address port_number\n", basename(argv[0]));
         return 1;
     }
-    const char *ip = argv[1];
+    const char* ip = argv[1];
     int port = atoi(argv[2]);
 
     struct sockaddr_in address;
@@ -51,31 +101,62 @@ int main(int argc, char *argv[]) {
     int sock = socket(PF_INET, SOCK_STREAM, 0);
     assert(sock >= 0);
 
-    int ret = bind(sock, (struct sockaddr *)&address, sizeof(address));
+    int ret = bind(sock, (struct sockaddr*)&address, sizeof(address));
     assert(ret != -1);
 
     ret = listen(sock, 5);
     assert(ret != -1);
 
-    struct sockaddr_in client;
-    socklen_t client_addrlength = sizeof(client);
-    connfd = accept(sock, (struct sockaddr *)&client, &client_addrlength);
-    if (connfd < 0) {
-        printf("errno is: %d\n", errno);
-    } else {
-        addsig(SIGURG, sig_urg);
-        fcntl(connfd, F_SETOWN, getpid());
-        char buffer[BUF_SIZE];
-        while (1) {
-            memset(buffer, '\0', BUF_SIZE);
-            ret = recv(connfd, buffer, BUF_SIZE - 1, 0);
-            if (ret <= 0) {
-                break;
+    conns = new connection[MAX_FD];
+    event_loop loop(MAX_EVENT_NUMBER);
+    loop.add(sock, EPOLLIN);
+    loop.set_priority(sock, event_loop::PRI_ACCEPT);
+
+    while (true) {
+        int number = loop.wait(-1);
+        if ((number < 0) && (errno != EINTR)) {
+            printf("epoll failure\n");
+            break;
+        }
+        epoll_event* events = loop.ready();
+
+        for (int i = 0; i < number; i++) {
+            int sockfd = events[i].data.fd;
+            if (sockfd == sock) {
+                struct sockaddr_in client;
+                socklen_t client_addrlength = sizeof(client);
+                int connfd =
+                    accept(sock, (struct sockaddr*)&client, &client_addrlength);
+                if (connfd < 0) {
+                    printf("errno is: %d\n", errno);
+                    continue;
+                }
+                if (connfd >= MAX_FD) {
+                    close(connfd);
+                    continue;
+                }
+                setnonblocking(connfd);
+                conns[connfd].fd = connfd;
+                conns[connfd].discarding = false;
+                conns[connfd].on_oob = flush_to_mark;
+                loop.add(connfd, EPOLLIN | EPOLLPRI | EPOLLRDHUP | EPOLLET);
+                continue;
+            }
+
+            connection* conn = &conns[sockfd];
+            if (events[i].events & EPOLLPRI) {
+                read_urgent(conn);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR)) {
+                if (!read_normal(conn)) {
+                    loop.del(sockfd, true);
+                    close(sockfd);
+                }
             }
-            printf("got %d bytes of normal data '%s'\n", ret, buffer);
         }
-        close(connfd);
     }
+
+    delete[] conns;
     close(sock);
     return 0;
 }
@@ -0,0 +1,99 @@
+#ifndef SIGNAL_SOURCE_H
+#define SIGNAL_SOURCE_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+#include <exception>
+
+// Signals as an ordinary readable fd, replacing the sig_handler +
+// socketpair forwarding of 01_unievent. The signals are blocked with
+// pthread_sigmask, as in chapter_14/04_sigmask.c, so no handler ever runs
+// and nothing is re-entered; one read() returns a whole batch of
+// signalfd_siginfo records, each with the sender's pid and, for SIGCHLD,
+// the child's status.
+//
+// Standard signals still coalesce while pending: one SIGCHLD record may
+// stand for several children, so keep reaping with waitpid(WNOHANG).
+//
+// Block the signals before creating threads, which inherit the mask. A
+// signalfd reports the signals of whichever process reads it, but epoll
+// only hears about it on the process that registered it: after fork the
+// child calls reopen() and adds the new fd() to its own epoll set. Before
+// exec call unblock(), the mask survives exec.
+class signal_source {
+public:
+    static const int MAX_BATCH = 64;
+
+public:
+    signal_source() : m_fd(-1), m_count(0) { sigemptyset(&m_mask); }
+
+    ~signal_source() {
+        if (m_fd != -1) {
+            close(m_fd);
+        }
+    }
+
+    void add(int sig) {
+        sigaddset(&m_mask, sig);
+        if (pthread_sigmask(SIG_BLOCK, &m_mask, NULL) != 0) {
+            throw std::exception();
+        }
+        // signalfd() on an existing fd only swaps its mask
+        m_fd = signalfd(m_fd, &m_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (m_fd == -1) {
+            throw std::exception();
+        }
+    }
+
+    void reopen() {
+        if (m_fd != -1) {
+            close(m_fd);
+        }
+        m_fd = signalfd(-1, &m_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (m_fd == -1) {
+            throw std::exception();
+        }
+    }
+
+    // drops the fd and restores default delivery, for a child that goes
+    // back to plain handlers or is about to exec
+    void unblock() {
+        if (m_fd != -1) {
+            close(m_fd);
+            m_fd = -1;
+        }
+        pthread_sigmask(SIG_UNBLOCK, &m_mask, NULL);
+    }
+
+    int fd() const { return m_fd; }
+
+    // one read() for up to MAX_BATCH pending signals; returns how many
+    // are in info(), 0 when none are pending
+    int read_batch() {
+        m_count = 0;
+        int ret;
+        do {
+            ret = read(m_fd, m_info, sizeof(m_info));
+        } while ((ret < 0) && (errno == EINTR));
+        if (ret > 0) {
+            m_count = ret / sizeof(signalfd_siginfo);
+        }
+        return m_count;
+    }
+
+    const signalfd_siginfo& info(int i) const { return m_info[i]; }
+    int count() const { return m_count; }
+
+private:
+    int m_fd;
+    sigset_t m_mask;
+    signalfd_siginfo m_info[MAX_BATCH];
+    int m_count;
+};
+
+#endif
@@ -4,6 +4,8 @@
 #include <netinet/in.h>
 #include <time.h>
 
+#include "time_cache.h"
+
 #define BUFFER_SIZE 64
 class util_timer;
 struct client_data {
@@ -105,7 +107,7 @@ public:
         if (!head) {
             return;
         }
-        time_t cur = time(NULL);
+        time_t cur = cached_time();
         util_timer *tmp = head;
         while (tmp) {
             if (cur < tmp->expire) {
@@ -14,12 +14,12 @@
 #include <unistd.h>
 
 #include "lst_timer.h"
+#include "signal_source.h"
 
 #define FD_LIMIT 65535
 #define MAX_EVENT_NUMBER 1024
 #define TIMESLOT 5
 
-static int pipefd[2];
 static sort_timer_lst timer_lst;
 static int epollfd = 0;
 
@@ -38,22 +38,6 @@ void addfd(int epollfd, int fd) {
     setnonblocking(fd);
 }
 
-void sig_handler(int sig) {
-    int save_errno = errno;
-    int msg = sig;
-    send(pipefd[1], (char*)&msg, 1, 0);
-    errno = save_errno;
-}
-
-void addsig(int sig) {
-    struct sigaction sa;
-    memset(&sa, '\0', sizeof(sa));
-    sa.sa_handler = sig_handler;
-    sa.sa_flags |= SA_RESTART;
-    sigfillset(&sa.sa_mask);
-    assert(sigaction(sig, &sa, NULL) != -1);
-}
-
 void timer_handler() {
     timer_lst.tick();
     alarm(TIMESLOT);
@@ -87,7 +71,8 @@ int main(int argc, char* argv[]) {
     ret = bind(listenfd, (struct sockaddr*)&address, sizeof(address));
     assert(ret != -1);
 
-    ret = listen(listenfd, 5);
+    // the kernel caps this at net.core.somaxconn
+    ret = listen(listenfd, SOMAXCONN);
     assert(ret != -1);
 
     epoll_event events[MAX_EVENT_NUMBER];
@@ -95,14 +80,11 @@ int main(int argc, char* argv[]) {
     assert(epollfd != -1);
     addfd(epollfd, listenfd);
 
-    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, pipefd);
-    assert(ret != -1);
-    setnonblocking(pipefd[1]);
-    addfd(epollfd, pipefd[0]);
-
     // add all the interesting signals here
-    addsig(SIGALRM);
-    addsig(SIGTERM);
+    signal_source signals;
+    signals.add(SIGALRM);
+    signals.add(SIGTERM);
+    addfd(epollfd, signals.fd());
     bool stop_server = false;
 
     client_data* users = new client_data[FD_LIMIT];
@@ -115,36 +97,47 @@ int main(int argc, char* argv[]) {
             printf("epoll failure\n");
             break;
         }
+        update_time_cache();
 
         for (int i = 0; i < number; i++) {
             int sockfd = events[i].data.fd;
             if (sockfd == listenfd) {
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof(client_address);
-                int connfd = accept(listenfd, (struct sockaddr*)&client_address,
-                                    &client_addrlength);
-                addfd(epollfd, connfd);
-                users[connfd].address = client_address;
-                users[connfd].sockfd = connfd;
-                util_timer* timer = new util_timer;
-                timer->user_data = &users[connfd];
-                timer->cb_func = cb_func;
-                time_t cur = time(NULL);
-                timer->expire = cur + 3 * TIMESLOT;
-                users[connfd].timer = timer;
-                timer_lst.add_timer(timer);
-            } else if ((sockfd == pipefd[0]) && (events[i].events & EPOLLIN)) {
-                int sig;
-                char signals[1024];
-                ret = recv(pipefd[0], signals, sizeof(signals), 0);
-                if (ret == -1) {
-                    // handle the error
-                    continue;
-                } else if (ret == 0) {
-                    continue;
-                } else {
-                    for (int i = 0; i < ret; ++i) {
-                        switch (signals[i]) {
+                // edge triggered: accept until the queue is empty
+                while (true) {
+                    struct sockaddr_in client_address;
+                    socklen_t client_addrlength = sizeof(client_address);
+                    int connfd = accept4(
+                        listenfd, (struct sockaddr*)&client_address,
+                        &client_addrlength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (connfd < 0) {
+                        if ((errno == ECONNABORTED) || (errno == EINTR)) {
+                            continue;
+                        }
+                        if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                            printf("errno is: %d\n", errno);
+                        }
+                        break;
+                    }
+                    if (connfd >= FD_LIMIT) {
+                        close(connfd);
+                        continue;
+                    }
+                    addfd(epollfd, connfd);
+                    users[connfd].address = client_address;
+                    users[connfd].sockfd = connfd;
+                    util_timer* timer = new util_timer;
+                    timer->user_data = &users[connfd];
+                    timer->cb_func = cb_func;
+                    time_t cur = cached_time();
+                    timer->expire = cur + 3 * TIMESLOT;
+                    users[connfd].timer = timer;
+                    timer_lst.add_timer(timer);
+                }
+            } else if ((sockfd == signals.fd()) &&
+                       (events[i].events & EPOLLIN)) {
+                while (signals.read_batch() > 0) {
+                    for (int j = 0; j < signals.count(); ++j) {
+                        switch (signals.info(j).ssi_signo) {
                             case SIGALRM: {
                                 timeout = true;
                                 break;
@@ -176,7 +169,7 @@ int main(int argc, char* argv[]) {
                 } else {
                     // send( sockfd, users[sockfd].buf, BUFFER_SIZE-1, 0 );
                     if (timer) {
-                        time_t cur = time(NULL);
+                        time_t cur = cached_time();
                         timer->expire = cur + 3 * TIMESLOT;
                         printf("adjust timer once\n");
                         timer_lst.adjust_timer(timer);
@@ -194,8 +187,6 @@ int main(int argc, char* argv[]) {
     }
 
     close(listenfd);
-    close(pipefd[1]);
-    close(pipefd[0]);
     delete[] users;
     return 0;
 }
@@ -5,6 +5,15 @@
 #include <stdio.h>
 #include <time.h>
 
+// per-tick tracing, compiled out unless built with -DTW_DEBUG
+#ifdef TW_DEBUG
+#define TW_TRACE(...) printf(__VA_ARGS__)
+#else
+#define TW_TRACE(...) \
+    do {              \
+    } while (0)
+#endif
+
 #define BUFFER_SIZE 64
 class tw_timer;
 struct client_data {
@@ -61,8 +70,8 @@ public:
         int ts = (cur_slot + (ticks % N)) % N;
         tw_timer* timer = new tw_timer(rotation, ts);
         if (!slots[ts]) {
-            printf("add timer, rotation is %d, ts is %d, cur_slot is %d\n",
-                   rotation, ts, cur_slot);
+            TW_TRACE("add timer, rotation is %d, ts is %d, cur_slot is %d\n",
+                     rotation, ts, cur_slot);
             slots[ts] = timer;
         } else {
             timer->next = slots[ts];
@@ -94,16 +103,16 @@ public:
     
     void tick() {
         tw_timer* tmp = slots[cur_slot];
-        printf("current slot is %d\n", cur_slot);
+        TW_TRACE("current slot is %d\n", cur_slot);
         while (tmp) {
-            printf("tick the timer once\n");
+            TW_TRACE("tick the timer once\n");
             if (tmp->rotation > 0) {
                 tmp->rotation--;
                 tmp = tmp->next;
             } else {
                 tmp->cb_func(tmp->user_data);
                 if (tmp == slots[cur_slot]) {
-                    printf("delete header in cur_slot\n");
+                    TW_TRACE("delete header in cur_slot\n");
                     slots[cur_slot] = tmp->next;
                     delete tmp;
                     if (slots[cur_slot]) {
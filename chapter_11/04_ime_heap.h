@@ -7,6 +7,8 @@
 #include <iostream>
 using std::exception;
 
+#include "time_cache.h"
+
 #define BUFFER_SIZE 64
 
 class heap_timer;
@@ -20,17 +22,33 @@ struct client_data {
 
 class heap_timer {
 public:
-    heap_timer(int delay) { expire = time(NULL) + delay; }
+    heap_timer(int delay)
+        : delay(delay), index(-1), common(-1), prev(NULL), next(NULL) {
+        expire = cached_time() + delay;
+    }
 
 public:
     time_t expire;
+    int delay;
     void (*cb_func)(client_data *);
     client_data *user_data;
+    int index;   // slot in the heap array
+    int common;  // common timeout queue, -1 when the timer lives in the heap
+    heap_timer *prev;
+    heap_timer *next;
+};
+
+// Timers sharing one duration expire in the order they were added, so a FIFO
+// list keeps them sorted and add/refresh become an O(1) append.
+struct common_timeout_list {
+    int duration;
+    heap_timer *head;
+    heap_timer *tail;
 };
 
 class time_heap {
 public:
-    time_heap(int cap) : capacity(cap), cur_size(0) {
+    time_heap(int cap) : capacity(cap), cur_size(0), n_common(0) {
         array = new heap_timer *[capacity];
         if (!array) {
             throw std::exception();
@@ -41,7 +59,7 @@ public:
     }
 
     time_heap(heap_timer **init_array, int size, int capacity)
-        : cur_size(size), capacity(capacity) {
+        : cur_size(size), capacity(capacity), n_common(0) {
         if (capacity < size) {
             throw std::exception();
         }
@@ -55,6 +73,7 @@ public:
         if (size != 0) {
             for (int i = 0; i < size; ++i) {
                 array[i] = init_array[i];
+                array[i]->index = i;
             }
             for (int i = (cur_size - 1) / 2; i >= 0; --i) {
                 percolate_down(i);
@@ -67,13 +86,44 @@ public:
             delete array[i];
         }
         delete[] array;
+        for (int i = 0; i < n_common; ++i) {
+            heap_timer *tmp = common[i].head;
+            while (tmp) {
+                common[i].head = tmp->next;
+                delete tmp;
+                tmp = common[i].head;
+            }
+        }
     }
 
 public:
+    // timers whose delay matches a registered duration bypass the heap
+    int add_common_timeout(int duration) {
+        for (int i = 0; i < n_common; ++i) {
+            if (common[i].duration == duration) {
+                return i;
+            }
+        }
+        if (n_common >= MAX_COMMON_TIMEOUTS) {
+            return -1;
+        }
+        common[n_common].duration = duration;
+        common[n_common].head = NULL;
+        common[n_common].tail = NULL;
+        return n_common++;
+    }
+
     void add_timer(heap_timer *timer) {
         if (!timer) {
             return;
         }
+        for (int i = 0; i < n_common; ++i) {
+            if (common[i].duration == timer->delay) {
+                timer->common = i;
+                append_common(timer);
+                return;
+            }
+        }
         if (cur_size >= capacity) {
             resize();
         }
@@ -85,40 +135,82 @@ public:
                 break;
             }
             array[hole] = array[parent];
+            array[hole]->index = hole;
         }
         array[hole] = timer;
+        timer->index = hole;
+    }
+
+    // push the expiry of a live timer delay seconds past now; not for a
+    // common timer whose callback is running, it is in no list any more
+    void adjust_timer(heap_timer *timer) {
+        if (!timer || ((timer->common == -1) && (timer->index == -1))) {
+            return;
+        }
+        timer->expire = cached_time() + timer->delay;
+        if (timer->common != -1) {
+            unlink_common(timer);
+            append_common(timer);
+        } else {
+            percolate_down(timer->index);
+        }
     }
 
     void del_timer(heap_timer *timer) {
         if (!timer) {
             return;
         }
+        if (timer->common != -1) {
+            unlink_common(timer);
+            delete timer;
+            return;
+        }
         // lazy delelte
         timer->cb_func = NULL;
     }
 
     heap_timer *top() const {
-        if (empty()) {
-            return NULL;
+        heap_timer *min = cur_size ? array[0] : NULL;
+        for (int i = 0; i < n_common; ++i) {
+            heap_timer *head = common[i].head;
+            if (head && (!min || head->expire < min->expire)) {
+                min = head;
+            }
         }
-        return array[0];
+        return min;
     }
 
     void pop_timer() {
-        if (empty()) {
+        if (cur_size == 0) {
             return;
         }
         if (array[0]) {
             delete array[0];
             array[0] = array[--cur_size];
-            percolate_down(0);
+            array[cur_size] = NULL;
+            if (cur_size > 0) {
+                percolate_down(0);
+            }
         }
     }
 
     void tick() {
-        heap_timer *tmp = array[0];
-        time_t cur = time(NULL);
-        while (!empty()) {
+        time_t cur = cached_time();
+        for (int i = 0; i < n_common; ++i) {
+            heap_timer *head = common[i].head;
+            while (head && head->expire <= cur) {
+                unlink_common(head);
+                // in no list now: a callback that calls del_timer() on its
+                // own timer only clears cb_func, the delete stays here
+                head->common = -1;
+                head->cb_func(head->user_data);
+                delete head;
+                head = common[i].head;
+            }
+        }
+
+        heap_timer *tmp = cur_size ? array[0] : NULL;
+        while (cur_size > 0) {
             if (!tmp) {
                 break;
             }
@@ -133,9 +225,37 @@ public:
         }
     }
 
-    bool empty() const { return cur_size == 0; }
+    bool empty() const { return top() == NULL; }
 
 private:
+    void append_common(heap_timer *timer) {
+        common_timeout_list &ctl = common[timer->common];
+        timer->prev = ctl.tail;
+        timer->next = NULL;
+        if (ctl.tail) {
+            ctl.tail->next = timer;
+        } else {
+            ctl.head = timer;
+        }
+        ctl.tail = timer;
+    }
+
+    void unlink_common(heap_timer *timer) {
+        common_timeout_list &ctl = common[timer->common];
+        if (timer->prev) {
+            timer->prev->next = timer->next;
+        } else {
+            ctl.head = timer->next;
+        }
+        if (timer->next) {
+            timer->next->prev = timer->prev;
+        } else {
+            ctl.tail = timer->prev;
+        }
+        timer->prev = NULL;
+        timer->next = NULL;
+    }
+
     void percolate_down(int hole) {
         heap_timer *temp = array[hole];
         int child = 0;
@@ -147,11 +267,13 @@ private:
             }
             if (array[child]->expire < temp->expire) {
                 array[hole] = array[child];
+                array[hole]->index = hole;
             } else {
                 break;
             }
         }
         array[hole] = temp;
+        temp->index = hole;
     }
 
     void resize() {
@@ -171,9 +293,12 @@ private:
     }
 
 private:
+    static const int MAX_COMMON_TIMEOUTS = 8;
     heap_timer **array;
     int capacity;
     int cur_size;
+    common_timeout_list common[MAX_COMMON_TIMEOUTS];
+    int n_common;
 };
 
 #endif
@@ -0,0 +1,65 @@
+#ifndef TIME_CACHE
+#define TIME_CACHE
+
+#include <stdio.h>
+#include <time.h>
+
+#include <atomic>
+
+// Per-iteration clock cache in the spirit of libevent's update_time_cache():
+// the event loop reads the clock once after epoll_wait returns and everything
+// running in that iteration (timers, Date headers, log stamps) reuses it.
+// Timer expiry uses CLOCK_MONOTONIC so wall-clock jumps cannot fire or stall
+// timers.
+struct time_cache_data {
+    std::atomic<time_t> mono;
+    std::atomic<time_t> wall;
+};
+
+inline time_cache_data &time_cache() {
+    static time_cache_data tc;
+    return tc;
+}
+
+inline time_t read_monotonic() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+inline void update_time_cache() {
+    time_cache().mono.store(read_monotonic(), std::memory_order_relaxed);
+    time_cache().wall.store(time(NULL), std::memory_order_relaxed);
+}
+
+// after this, readers go to the clock until the next update
+inline void clear_time_cache() {
+    time_cache().mono.store(0, std::memory_order_relaxed);
+    time_cache().wall.store(0, std::memory_order_relaxed);
+}
+
+inline time_t cached_time() {
+    time_t t = time_cache().mono.load(std::memory_order_relaxed);
+    return t ? t : read_monotonic();
+}
+
+inline time_t cached_wall_time() {
+    time_t t = time_cache().wall.load(std::memory_order_relaxed);
+    return t ? t : time(NULL);
+}
+
+// RFC 7231 IMF-fixdate, formatted at most once per second per thread
+inline const char *cached_http_date() {
+    static __thread char buf[32];
+    static __thread time_t formatted = 0;
+    time_t now = cached_wall_time();
+    if (now != formatted) {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        formatted = now;
+    }
+    return buf;
+}
+
+#endif
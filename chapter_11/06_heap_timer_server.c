@@ -0,0 +1,187 @@
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "ime_heap.h"
+#include "signal_source.h"
+
+#define FD_LIMIT 65535
+#define MAX_EVENT_NUMBER 1024
+#define IDLE_TIMEOUT 15
+
+// 02_timer_server on time_heap: no SIGALRM, epoll_wait sleeps until the
+// nearest expiry. Every connection has the same idle timeout, so they all
+// share one common timeout list and adding or refreshing a timer is an
+// O(1) append instead of a heap operation.
+static time_heap timers(64);
+static int epollfd = -1;
+
+int setnonblocking(int fd) {
+    int old_option = fcntl(fd, F_GETFL);
+    int new_option = old_option | O_NONBLOCK;
+    fcntl(fd, F_SETFL, new_option);
+    return old_option;
+}
+
+void addfd(int epollfd, int fd) {
+    epoll_event event;
+    event.data.fd = fd;
+    event.events = EPOLLIN | EPOLLET;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
+    setnonblocking(fd);
+}
+
+// timer callback: the connection was idle for IDLE_TIMEOUT seconds; tick()
+// deletes the timer itself
+void cb_func(client_data* user_data) {
+    assert(user_data);
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, user_data->sockfd, 0);
+    close(user_data->sockfd);
+    user_data->timer = NULL;
+    printf("close idle fd %d\n", user_data->sockfd);
+}
+
+void close_conn(client_data* user_data) {
+    timers.del_timer(user_data->timer);
+    user_data->timer = NULL;
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, user_data->sockfd, 0);
+    close(user_data->sockfd);
+    printf("close fd %d\n", user_data->sockfd);
+}
+
+// milliseconds until the nearest timer, -1 with none
+int next_timeout() {
+    heap_timer* timer = timers.top();
+    if (!timer) {
+        return -1;
+    }
+    time_t left = timer->expire - cached_time();
+    return (left > 0) ? left * 1000 : 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc <= 2) {
+        printf("usage: %s ip_address port_number\n", basename(argv[0]));
+        return 1;
+    }
+    const char* ip = argv[1];
+    int port = atoi(argv[2]);
+
+    int ret = 0;
+    struct sockaddr_in address;
+    bzero(&address, sizeof(address));
+    address.sin_family = AF_INET;
+    inet_pton(AF_INET, ip, &address.sin_addr);
+    address.sin_port = htons(port);
+
+    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
+    assert(listenfd >= 0);
+
+    ret = bind(listenfd, (struct sockaddr*)&address, sizeof(address));
+    assert(ret != -1);
+
+    // the kernel caps this at net.core.somaxconn
+    ret = listen(listenfd, SOMAXCONN);
+    assert(ret != -1);
+
+    epoll_event events[MAX_EVENT_NUMBER];
+    epollfd = epoll_create(5);
+    assert(epollfd != -1);
+    addfd(epollfd, listenfd);
+
+    signal_source signals;
+    signals.add(SIGTERM);
+    addfd(epollfd, signals.fd());
+    bool stop_server = false;
+
+    ret = timers.add_common_timeout(IDLE_TIMEOUT);
+    assert(ret != -1);
+
+    client_data* users = new client_data[FD_LIMIT];
+
+    while (!stop_server) {
+        int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER,
+                                next_timeout());
+        if ((number < 0) && (errno != EINTR)) {
+            printf("epoll failure\n");
+            break;
+        }
+        update_time_cache();
+
+        for (int i = 0; i < number; i++) {
+            int sockfd = events[i].data.fd;
+            if (sockfd == listenfd) {
+                // edge triggered: accept until the queue is empty
+                while (true) {
+                    struct sockaddr_in client_address;
+                    socklen_t client_addrlength = sizeof(client_address);
+                    int connfd = accept4(
+                        listenfd, (struct sockaddr*)&client_address,
+                        &client_addrlength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (connfd < 0) {
+                        if ((errno == ECONNABORTED) || (errno == EINTR)) {
+                            continue;
+                        }
+                        if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                            printf("errno is: %d\n", errno);
+                        }
+                        break;
+                    }
+                    if (connfd >= FD_LIMIT) {
+                        close(connfd);
+                        continue;
+                    }
+                    addfd(epollfd, connfd);
+                    users[connfd].address = client_address;
+                    users[connfd].sockfd = connfd;
+                    heap_timer* timer = new heap_timer(IDLE_TIMEOUT);
+                    timer->user_data = &users[connfd];
+                    timer->cb_func = cb_func;
+                    users[connfd].timer = timer;
+                    timers.add_timer(timer);
+                }
+            } else if ((sockfd == signals.fd()) &&
+                       (events[i].events & EPOLLIN)) {
+                while (signals.read_batch() > 0) {
+                    for (int j = 0; j < signals.count(); ++j) {
+                        if (signals.info(j).ssi_signo == SIGTERM) {
+                            stop_server = true;
+                        }
+                    }
+                }
+            } else if (events[i].events & EPOLLIN) {
+                memset(users[sockfd].buf, '\0', BUFFER_SIZE);
+                ret = recv(sockfd, users[sockfd].buf, BUFFER_SIZE - 1, 0);
+                printf("get %d bytes of client data %s from %d\n", ret,
+                       users[sockfd].buf, sockfd);
+                if (ret < 0) {
+                    if (errno != EAGAIN) {
+                        close_conn(&users[sockfd]);
+                    }
+                } else if (ret == 0) {
+                    close_conn(&users[sockfd]);
+                } else {
+                    // moved to the tail of the idle list
+                    timers.adjust_timer(users[sockfd].timer);
+                }
+            }
+        }
+
+        timers.tick();
+    }
+
+    close(listenfd);
+    close(epollfd);
+    delete[] users;
+    return 0;
+}
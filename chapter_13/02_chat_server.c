@@ -6,35 +6,74 @@
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
-#define USER_LIMIT 5
+#include <atomic>
+
+#include "child_supervisor.h"
+#include "signal_source.h"
+
+#define USER_LIMIT 4096
 #define BUFFER_SIZE 1024
 #define FD_LIMIT 65535
 #define MAX_EVENT_NUMBER 1024
-#define PROCESS_LIMIT 65536
+#define RING_SLOTS 4096  // power of two
 
 struct client_data {
     sockaddr_in address;
     int connfd;
     pid_t pid;
-    int pipefd[2];
+    int reader;  // slot in broadcast_ring::readers
+};
+
+// Multi-producer broadcast ring in shared memory. A writer claims message
+// number n from head, and stamps its slot with 2n+1 while copying and 2n+2
+// once published. Every reader keeps its own cursor, so the parent is not
+// involved per message. A reader that falls RING_SLOTS behind skips to the
+// oldest message still in the ring.
+struct ring_slot {
+    std::atomic<uint64_t> seq;
+    int sender;
+    int length;
+    char data[BUFFER_SIZE];
+};
+
+struct ring_reader {
+    std::atomic<int> active;
+    // set while the reader sleeps in epoll_wait, a writer that clears it
+    // owes the reader a wakeup on its eventfd
+    std::atomic<int> waiting;
+    std::atomic<uint64_t> dropped;
+};
+
+struct broadcast_ring {
+    std::atomic<uint64_t> head;
+    std::atomic<int> reader_high;  // readers above this were never used
+    ring_reader readers[USER_LIMIT];
+    ring_slot slots[RING_SLOTS];
 };
 
 static const char* shm_name = "/my_shm";
-int sig_pipefd[2];
+signal_source signals;
 int epollfd;
 int listenfd;
 int shmfd;
-char* share_mem = 0;
+broadcast_ring* ring = 0;
+// one eventfd per reader slot, created before any fork so every writer
+// can wake every reader
+int reader_efd[USER_LIMIT];
+int reader_capacity = 0;
 client_data* users = 0;
-int* sub_process = 0;
+child_supervisor* children = 0;  // slot i watches users[i].pid
 int user_count = 0;
 bool stop_child = false;
 
@@ -45,21 +84,17 @@ int setnonblocking(int fd) {
     return old_option;
 }
 
-void addfd(int epollfd, int fd) {
+void addfd(int epollfd, int fd, bool out = false) {
     epoll_event event;
     event.data.fd = fd;
     event.events = EPOLLIN | EPOLLET;
+    if (out) {
+        event.events |= EPOLLOUT;
+    }
     epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
     setnonblocking(fd);
 }
 
-void sig_handler(int sig) {
-    int save_errno = errno;
-    int msg = sig;
-    send(sig_pipefd[1], (char*)&msg, 1, 0);
-    errno = save_errno;
-}
-
 void addsig(int sig, void (*handler)(int), bool restart = true) {
     struct sigaction sa;
     memset(&sa, '\0', sizeof(sa));
@@ -72,30 +107,129 @@ void addsig(int sig, void (*handler)(int), bool restart = true) {
 }
 
 void del_resource() {
-    close(sig_pipefd[0]);
-    close(sig_pipefd[1]);
     close(listenfd);
     close(epollfd);
     shm_unlink(shm_name);
+    munmap((void*)ring, sizeof(broadcast_ring));
+    for (int i = 0; i < reader_capacity; ++i) {
+        close(reader_efd[i]);
+    }
     delete[] users;
-    delete[] sub_process;
+    delete children;
 }
 
 void child_term_handler(int sig) { stop_child = true; }
 
-int run_child(int idx, client_data* users, char* share_mem) {
+void publish(int me, const char* data, int len) {
+    uint64_t n = ring->head.fetch_add(1);
+    ring_slot& slot = ring->slots[n & (RING_SLOTS - 1)];
+    slot.seq.store(2 * n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.sender = me;
+    slot.length = len;
+    memcpy(slot.data, data, len);
+    slot.seq.store(2 * n + 2, std::memory_order_seq_cst);
+
+    int high = ring->reader_high.load();
+    for (int i = 0; i < high; ++i) {
+        if ((i != me) && ring->readers[i].waiting.load() &&
+            ring->readers[i].waiting.exchange(0)) {
+            uint64_t one = 1;
+            write(reader_efd[i], &one, sizeof(one));
+        }
+    }
+}
+
+bool published(uint64_t cursor) {
+    return ring->slots[cursor & (RING_SLOTS - 1)].seq.load() >= 2 * cursor + 2;
+}
+
+struct outbox {
+    char data[BUFFER_SIZE];
+    int len;
+    int sent;
+};
+
+// sends what the client has not seen yet, returns false once the socket is
+// full; the rest waits in the ring for the next EPOLLOUT
+bool deliver(int me, int connfd, uint64_t& cursor, outbox& out) {
+    while (true) {
+        while (out.sent < out.len) {
+            int ret = send(connfd, out.data + out.sent, out.len - out.sent, 0);
+            if (ret < 0) {
+                if (errno == EAGAIN) {
+                    return false;
+                }
+                stop_child = true;
+                return false;
+            }
+            out.sent += ret;
+        }
+
+        ring_slot& slot = ring->slots[cursor & (RING_SLOTS - 1)];
+        uint64_t seq = slot.seq.load(std::memory_order_acquire);
+        if (seq < 2 * cursor + 2) {
+            return true;
+        }
+        if (seq == 2 * cursor + 2) {
+            int sender = slot.sender;
+            int len = slot.length;
+            memcpy(out.data, slot.data, len);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.seq.load(std::memory_order_relaxed) == seq) {
+                cursor++;
+                if (sender != me) {
+                    out.len = len;
+                    out.sent = 0;
+                }
+                continue;
+            }
+        }
+        // overwritten before we got to it
+        uint64_t head = ring->head.load();
+        uint64_t oldest = head > RING_SLOTS ? head - RING_SLOTS : 0;
+        if (oldest > cursor) {
+            ring->readers[me].dropped += oldest - cursor;
+            cursor = oldest;
+        } else {
+            cursor++;
+        }
+    }
+}
+
+int run_child(int idx, client_data* users) {
     epoll_event events[MAX_EVENT_NUMBER];
     int child_epollfd = epoll_create(5);
     assert(child_epollfd != -1);
     int connfd = users[idx].connfd;
-    addfd(child_epollfd, connfd);
-    int pipefd = users[idx].pipefd[1];
-    addfd(child_epollfd, pipefd);
+    addfd(child_epollfd, connfd, true);
+    int me = users[idx].reader;
+    ring_reader& self = ring->readers[me];
+    int efd = reader_efd[me];
+    addfd(child_epollfd, efd);
     int ret;
     addsig(SIGTERM, child_term_handler, false);
 
+    uint64_t cursor = ring->head.load();
+    outbox out;
+    out.len = out.sent = 0;
+    char buf[BUFFER_SIZE];
+    bool writable = true;
+
     while (!stop_child) {
-        int number = epoll_wait(child_epollfd, events, MAX_EVENT_NUMBER, -1);
+        if (writable) {
+            writable = deliver(me, connfd, cursor, out);
+        }
+        // announce the sleep first, then look once more: a writer either
+        // sees the flag or we see its message
+        int timeout = -1;
+        self.waiting.store(1);
+        if (writable && published(cursor)) {
+            timeout = 0;
+        }
+        int number =
+            epoll_wait(child_epollfd, events, MAX_EVENT_NUMBER, timeout);
+        self.waiting.store(0);
         if ((number < 0) && (errno != EINTR)) {
             printf("epoll failure\n");
             break;
@@ -103,40 +237,34 @@ int run_child(int idx, client_data* users, char* share_mem) {
 
         for (int i = 0; i < number; i++) {
             int sockfd = events[i].data.fd;
-            if ((sockfd == connfd) && (events[i].events & EPOLLIN)) {
-                memset(share_mem + idx * BUFFER_SIZE, '\0', BUFFER_SIZE);
-                ret = recv(connfd, share_mem + idx * BUFFER_SIZE,
-                           BUFFER_SIZE - 1, 0);
-                if (ret < 0) {
-                    if (errno != EAGAIN) {
-                        stop_child = true;
-                    }
-                } else if (ret == 0) {
-                    stop_child = true;
-                } else {
-                    send(pipefd, (char*)&idx, sizeof(idx), 0);
+            if (sockfd == connfd) {
+                if (events[i].events & EPOLLOUT) {
+                    writable = true;
+                }
+                if (!(events[i].events & EPOLLIN)) {
+                    continue;
                 }
-            } else if ((sockfd == pipefd) && (events[i].events & EPOLLIN)) {
-                int client = 0;
-                ret = recv(sockfd, (char*)&client, sizeof(client), 0);
-                if (ret < 0) {
-                    if (errno != EAGAIN) {
+                while (true) {
+                    ret = recv(connfd, buf, BUFFER_SIZE, 0);
+                    if (ret < 0) {
+                        if (errno != EAGAIN) {
+                            stop_child = true;
+                        }
+                        break;
+                    } else if (ret == 0) {
                         stop_child = true;
+                        break;
                     }
-                } else if (ret == 0) {
-                    stop_child = true;
-                } else {
-                    send(connfd, share_mem + client * BUFFER_SIZE, BUFFER_SIZE,
-                         0);
+                    publish(me, buf, ret);
                 }
-            } else {
-                continue;
+            } else if (sockfd == efd) {
+                uint64_t count;
+                read(efd, &count, sizeof(count));
             }
         }
     }
 
     close(connfd);
-    close(pipefd);
     close(child_epollfd);
     return 0;
 }
@@ -162,42 +290,54 @@ int main(int argc, char* argv[]) {
     ret = bind(listenfd, (struct sockaddr*)&address, sizeof(address));
     assert(ret != -1);
 
-    ret = listen(listenfd, 5);
+    // the kernel caps this at net.core.somaxconn
+    ret = listen(listenfd, SOMAXCONN);
     assert(ret != -1);
 
+    // every process holds all reader eventfds
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    for (reader_capacity = 0; reader_capacity < USER_LIMIT;
+         ++reader_capacity) {
+        reader_efd[reader_capacity] = eventfd(0, EFD_NONBLOCK);
+        if (reader_efd[reader_capacity] < 0) {
+            break;
+        }
+    }
+    assert(reader_capacity > 0);
+    printf("room for %d users\n", reader_capacity);
+
     user_count = 0;
     users = new client_data[USER_LIMIT + 1];
-    sub_process = new int[PROCESS_LIMIT];
-    for (int i = 0; i < PROCESS_LIMIT; ++i) {
-        sub_process[i] = -1;
-    }
+    children = new child_supervisor(USER_LIMIT + 1);
 
     epoll_event events[MAX_EVENT_NUMBER];
     epollfd = epoll_create(5);
     assert(epollfd != -1);
     addfd(epollfd, listenfd);
 
-    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sig_pipefd);
-    assert(ret != -1);
-    setnonblocking(sig_pipefd[1]);
-    addfd(epollfd, sig_pipefd[0]);
-
-    addsig(SIGCHLD, sig_handler);
-    addsig(SIGTERM, sig_handler);
-    addsig(SIGINT, sig_handler);
+    signals.add(SIGTERM);
+    signals.add(SIGINT);
+    addfd(epollfd, signals.fd());
+    addfd(epollfd, children->fd());
     addsig(SIGPIPE, SIG_IGN);
     bool stop_server = false;
     bool terminate = false;
 
     shmfd = shm_open(shm_name, O_CREAT | O_RDWR, 0666);
     assert(shmfd != -1);
-    ret = ftruncate(shmfd, USER_LIMIT * BUFFER_SIZE);
+    ret = ftruncate(shmfd, sizeof(broadcast_ring));
     assert(ret != -1);
 
-    share_mem = (char*)mmap(NULL, USER_LIMIT * BUFFER_SIZE,
-                            PROT_READ | PROT_WRITE, MAP_SHARED, shmfd, 0);
-    assert(share_mem != MAP_FAILED);
+    ring = (broadcast_ring*)mmap(NULL, sizeof(broadcast_ring),
+                                 PROT_READ | PROT_WRITE, MAP_SHARED, shmfd, 0);
+    assert(ring != MAP_FAILED);
     close(shmfd);
+    // all zero is an empty ring; the object may be left over from a crash
+    memset((void*)ring, 0, sizeof(broadcast_ring));
 
     while (!stop_server) {
         int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
@@ -209,87 +349,89 @@ int main(int argc, char* argv[]) {
         for (int i = 0; i < number; i++) {
             int sockfd = events[i].data.fd;
             if (sockfd == listenfd) {
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof(client_address);
-                int connfd = accept(listenfd, (struct sockaddr*)&client_address,
-                                    &client_addrlength);
-                if (connfd < 0) {
-                    printf("errno is: %d\n", errno);
-                    continue;
+                // edge triggered: accept until the queue is empty
+                while (true) {
+                    struct sockaddr_in client_address;
+                    socklen_t client_addrlength = sizeof(client_address);
+                    int connfd = accept4(
+                        listenfd, (struct sockaddr*)&client_address,
+                        &client_addrlength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (connfd < 0) {
+                        if ((errno == ECONNABORTED) || (errno == EINTR)) {
+                            continue;
+                        }
+                        if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                            printf("errno is: %d\n", errno);
+                        }
+                        break;
+                    }
+                    if (user_count >= reader_capacity) {
+                        const char* info = "too many users\n";
+                        printf("%s", info);
+                        send(connfd, info, strlen(info), 0);
+                        close(connfd);
+                        continue;
+                    }
+                    int reader = 0;
+                    while (ring->readers[reader].active.load()) {
+                        reader++;
+                    }
+                    ring->readers[reader].waiting.store(0);
+                    ring->readers[reader].dropped.store(0);
+                    ring->readers[reader].active.store(1);
+                    if (reader >= ring->reader_high.load()) {
+                        ring->reader_high.store(reader + 1);
+                    }
+                    users[user_count].address = client_address;
+                    users[user_count].connfd = connfd;
+                    users[user_count].reader = reader;
+                    pid_t pid = fork();
+                    if (pid < 0) {
+                        ring->readers[reader].active.store(0);
+                        close(connfd);
+                        continue;
+                    } else if (pid == 0) {
+                        close(epollfd);
+                        close(listenfd);
+                        // the child stops on a plain SIGTERM handler
+                        signals.unblock();
+                        children->release();
+                        run_child(user_count, users);
+                        munmap((void*)ring, sizeof(broadcast_ring));
+                        exit(0);
+                    } else {
+                        close(connfd);
+                        users[user_count].pid = pid;
+                        if (!children->watch(user_count, pid)) {
+                            printf("errno is: %d\n", errno);
+                        }
+                        user_count++;
+                    }
                 }
-                if (user_count >= USER_LIMIT) {
-                    const char* info = "too many users\n";
-                    printf("%s", info);
-                    send(connfd, info, strlen(info), 0);
-                    close(connfd);
-                    continue;
+            } else if ((sockfd == children->fd()) &&
+                       (events[i].events & EPOLLIN)) {
+                int del_user;
+                int stat;
+                while ((del_user = children->next_exit(&stat)) != -1) {
+                    ring_reader& r = ring->readers[users[del_user].reader];
+                    if (r.dropped.load()) {
+                        printf("user %d fell %lu messages behind\n", del_user,
+                               (unsigned long)r.dropped.load());
+                    }
+                    r.active.store(0);
+                    users[del_user] = users[--user_count];
+                    children->move(user_count, del_user);
+                    printf("child %d exit, now we have %d users\n", del_user,
+                           user_count);
                 }
-                users[user_count].address = client_address;
-                users[user_count].connfd = connfd;
-                ret = socketpair(PF_UNIX, SOCK_STREAM, 0,
-                                 users[user_count].pipefd);
-                assert(ret != -1);
-                pid_t pid = fork();
-                if (pid < 0) {
-                    close(connfd);
-                    continue;
-                } else if (pid == 0) {
-                    close(epollfd);
-                    close(listenfd);
-                    close(users[user_count].pipefd[0]);
-                    close(sig_pipefd[0]);
-                    close(sig_pipefd[1]);
-                    run_child(user_count, users, share_mem);
-                    munmap((void*)share_mem, USER_LIMIT * BUFFER_SIZE);
-                    exit(0);
-                } else {
-                    close(connfd);
-                    close(users[user_count].pipefd[1]);
-                    addfd(epollfd, users[user_count].pipefd[0]);
-                    users[user_count].pid = pid;
-                    sub_process[pid] = user_count;
-                    user_count++;
+                if (terminate && user_count == 0) {
+                    stop_server = true;
                 }
-            } else if ((sockfd == sig_pipefd[0]) &&
+            } else if ((sockfd == signals.fd()) &&
                        (events[i].events & EPOLLIN)) {
-                int sig;
-                char signals[1024];
-                ret = recv(sig_pipefd[0], signals, sizeof(signals), 0);
-                if (ret == -1) {
-                    continue;
-                } else if (ret == 0) {
-                    continue;
-                } else {
-                    for (int i = 0; i < ret; ++i) {
-                        switch (signals[i]) {
-                            case SIGCHLD: {
-                                pid_t pid;
-                                int stat;
-                                while ((pid = waitpid(-1, &stat, WNOHANG)) >
-                                       0) {
-                                    int del_user = sub_process[pid];
-                                    sub_process[pid] = -1;
-                                    if ((del_user < 0) ||
-                                        (del_user > USER_LIMIT)) {
-                                        printf(
-                                            "the deleted user was not "
-                                            "change\n");
-                                        continue;
-                                    }
-                                    epoll_ctl(epollfd, EPOLL_CTL_DEL,
-                                              users[del_user].pipefd[0], 0);
-                                    close(users[del_user].pipefd[0]);
-                                    users[del_user] = users[--user_count];
-                                    sub_process[users[del_user].pid] = del_user;
-                                    printf(
-                                        "child %d exit, now we have %d users\n",
-                                        del_user, user_count);
-                                }
-                                if (terminate && user_count == 0) {
-                                    stop_server = true;
-                                }
-                                break;
-                            }
+                while (signals.read_batch() > 0) {
+                    for (int i = 0; i < signals.count(); ++i) {
+                        switch (signals.info(i).ssi_signo) {
                             case SIGTERM:
                             case SIGINT: {
                                 printf("kill all the clild now\n");
@@ -312,23 +454,6 @@ int main(int argc, char* argv[]) {
                         }
                     }
                 }
-            } else if (events[i].events & EPOLLIN) {
-                int child = 0;
-                ret = recv(sockfd, (char*)&child, sizeof(child), 0);
-                printf("read data from child accross pipe\n");
-                if (ret == -1) {
-                    continue;
-                } else if (ret == 0) {
-                    continue;
-                } else {
-                    for (int j = 0; j < user_count; ++j) {
-                        if (users[j].pipefd[0] != sockfd) {
-                            printf("send data to child accross pipe\n");
-                            send(users[j].pipefd[0], (char*)&child,
-                                 sizeof(child), 0);
-                        }
-                    }
-                }
             }
         }
     }
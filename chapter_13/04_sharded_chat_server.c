@@ -0,0 +1,455 @@
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <deque>
+#include <vector>
+
+#include "locker.h"
+#include "signal_source.h"
+
+// The chat room of 02_chat_server without a process per user: a fixed
+// number of shard threads each own a share of the connections in their
+// own epoll set. A message is stored once, reference counted, and queued
+// on every recipient's output queue; each round a shard flushes the queues
+// it touched with writev. A reader whose queue passes OUTPUT_HIGH_WATER is
+// disconnected rather than letting it hold memory for the whole room.
+
+#define BUFFER_SIZE 1024
+#define MAX_EVENT_NUMBER 1024
+#define MAX_SHARDS 64
+#define OUTPUT_HIGH_WATER (256 * 1024)
+#define MAX_IOV 64
+
+struct message {
+    std::atomic<int> refs;
+    unsigned long sender;
+    int len;
+    char data[BUFFER_SIZE];
+};
+
+struct connection {
+    int fd;
+    unsigned long id;
+    int member_idx;  // position in shard::members
+    std::deque<message*> out;
+    int out_off;  // bytes of out.front() already sent
+    long queued;  // bytes waiting in out
+    bool dirty;   // in shard::dirty
+    bool dead;
+};
+
+struct shard {
+    pthread_t tid;
+    int epollfd;
+    int wakefd;
+    locker lock;
+    std::vector<int> new_fds;       // guarded by lock
+    std::vector<message*> inbox;    // guarded by lock
+    std::vector<connection*> members;
+    std::vector<connection*> dirty;
+    std::vector<connection*> graveyard;
+    long delivered;
+    long cut_off;
+};
+
+signal_source signals;
+int epollfd;
+int listenfd;
+shard* shards = 0;
+int shard_count = 0;
+std::atomic<unsigned long> next_conn_id(1);
+std::atomic<bool> stop_server(false);
+
+int setnonblocking(int fd) {
+    int old_option = fcntl(fd, F_GETFL);
+    int new_option = old_option | O_NONBLOCK;
+    fcntl(fd, F_SETFL, new_option);
+    return old_option;
+}
+
+void addfd(int epollfd, int fd, bool out = false) {
+    epoll_event event;
+    event.data.fd = fd;
+    event.events = EPOLLIN | EPOLLET;
+    if (out) {
+        event.events |= EPOLLOUT;
+    }
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
+    setnonblocking(fd);
+}
+
+void addsig(int sig, void (*handler)(int), bool restart = true) {
+    struct sigaction sa;
+    memset(&sa, '\0', sizeof(sa));
+    sa.sa_handler = handler;
+    if (restart) {
+        sa.sa_flags |= SA_RESTART;
+    }
+    sigfillset(&sa.sa_mask);
+    assert(sigaction(sig, &sa, NULL) != -1);
+}
+
+void wake(shard* s) {
+    uint64_t one = 1;
+    write(s->wakefd, &one, sizeof(one));
+}
+
+void put_message(message* msg) {
+    if (msg->refs.fetch_sub(1) == 1) {
+        delete msg;
+    }
+}
+
+void close_conn(shard* s, connection* c) {
+    if (c->dead) {
+        return;
+    }
+    c->dead = true;
+    connection* last = s->members.back();
+    s->members[c->member_idx] = last;
+    last->member_idx = c->member_idx;
+    s->members.pop_back();
+    // closing drops it from the epoll set
+    close(c->fd);
+    // freed after this round, it may still sit in dirty
+    s->graveyard.push_back(c);
+}
+
+void enqueue(shard* s, connection* c, message* msg) {
+    if (c->dead || (c->id == msg->sender)) {
+        return;
+    }
+    if (c->queued + msg->len > OUTPUT_HIGH_WATER) {
+        printf("cutting off slow reader %lu with %ld bytes queued\n", c->id,
+               c->queued);
+        s->cut_off++;
+        close_conn(s, c);
+        return;
+    }
+    msg->refs++;
+    c->out.push_back(msg);
+    c->queued += msg->len;
+    if (!c->dirty) {
+        c->dirty = true;
+        s->dirty.push_back(c);
+    }
+}
+
+void flush(shard* s, connection* c) {
+    while (!c->out.empty()) {
+        struct iovec iv[MAX_IOV];
+        int count = 0;
+        for (size_t i = 0; (i < c->out.size()) && (count < MAX_IOV); ++i) {
+            message* msg = c->out[i];
+            int off = i ? 0 : c->out_off;
+            iv[count].iov_base = msg->data + off;
+            iv[count].iov_len = msg->len - off;
+            count++;
+        }
+        ssize_t ret = writev(c->fd, iv, count);
+        if (ret < 0) {
+            if (errno != EAGAIN) {
+                close_conn(s, c);
+            }
+            // EPOLLOUT picks it up again
+            return;
+        }
+        c->queued -= ret;
+        while (ret > 0) {
+            message* msg = c->out.front();
+            int left = msg->len - c->out_off;
+            if (ret < left) {
+                c->out_off += ret;
+                break;
+            }
+            ret -= left;
+            c->out_off = 0;
+            c->out.pop_front();
+            put_message(msg);
+            s->delivered++;
+        }
+    }
+}
+
+// one reference per shard, each drops it after queueing to its members
+void publish(shard* from, connection* c, const char* data, int len) {
+    message* msg = new message;
+    msg->refs = shard_count;
+    msg->sender = c->id;
+    msg->len = len;
+    memcpy(msg->data, data, len);
+    for (int i = 0; i < shard_count; ++i) {
+        shard* s = &shards[i];
+        if (s == from) {
+            continue;
+        }
+        s->lock.lock();
+        bool was_empty = s->inbox.empty();
+        s->inbox.push_back(msg);
+        s->lock.unlock();
+        // a non-empty inbox already has a wakeup pending
+        if (was_empty) {
+            wake(s);
+        }
+    }
+    // backwards: a member cut off here is replaced by the last one
+    for (int i = (int)from->members.size() - 1; i >= 0; --i) {
+        enqueue(from, from->members[i], msg);
+    }
+    put_message(msg);
+}
+
+void adopt(shard* s, int fd) {
+    connection* c = new connection;
+    c->fd = fd;
+    c->id = next_conn_id++;
+    c->out_off = 0;
+    c->queued = 0;
+    c->dirty = false;
+    c->dead = false;
+    c->member_idx = s->members.size();
+    s->members.push_back(c);
+    // data.ptr rather than fd: fds are recycled while stale events are
+    // still in the batch
+    epoll_event event;
+    event.data.ptr = c;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    epoll_ctl(s->epollfd, EPOLL_CTL_ADD, fd, &event);
+}
+
+void drain_inbox(shard* s) {
+    uint64_t count;
+    read(s->wakefd, &count, sizeof(count));
+    std::vector<int> fds;
+    std::vector<message*> msgs;
+    s->lock.lock();
+    fds.swap(s->new_fds);
+    msgs.swap(s->inbox);
+    s->lock.unlock();
+
+    for (size_t i = 0; i < fds.size(); ++i) {
+        adopt(s, fds[i]);
+    }
+    for (size_t i = 0; i < msgs.size(); ++i) {
+        for (int j = (int)s->members.size() - 1; j >= 0; --j) {
+            enqueue(s, s->members[j], msgs[i]);
+        }
+        put_message(msgs[i]);
+    }
+}
+
+void* run_shard(void* arg) {
+    shard* s = (shard*)arg;
+    epoll_event events[MAX_EVENT_NUMBER];
+    char buf[BUFFER_SIZE];
+
+    while (!stop_server) {
+        int number = epoll_wait(s->epollfd, events, MAX_EVENT_NUMBER, -1);
+        if ((number < 0) && (errno != EINTR)) {
+            printf("epoll failure\n");
+            break;
+        }
+
+        for (int i = 0; i < number; i++) {
+            if (events[i].data.ptr == NULL) {
+                drain_inbox(s);
+                continue;
+            }
+            connection* c = (connection*)events[i].data.ptr;
+            if (c->dead) {
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                if (!c->dirty && !c->out.empty()) {
+                    c->dirty = true;
+                    s->dirty.push_back(c);
+                }
+            }
+            if (!(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+                continue;
+            }
+            while (true) {
+                int ret = recv(c->fd, buf, BUFFER_SIZE, 0);
+                if (ret < 0) {
+                    if (errno != EAGAIN) {
+                        close_conn(s, c);
+                    }
+                    break;
+                } else if (ret == 0) {
+                    close_conn(s, c);
+                    break;
+                }
+                publish(s, c, buf, ret);
+            }
+        }
+
+        for (size_t i = 0; i < s->dirty.size(); ++i) {
+            connection* c = s->dirty[i];
+            c->dirty = false;
+            if (!c->dead) {
+                flush(s, c);
+            }
+        }
+        s->dirty.clear();
+        for (size_t i = 0; i < s->graveyard.size(); ++i) {
+            connection* c = s->graveyard[i];
+            while (!c->out.empty()) {
+                put_message(c->out.front());
+                c->out.pop_front();
+            }
+            delete c;
+        }
+        s->graveyard.clear();
+    }
+
+    while (!s->members.empty()) {
+        close_conn(s, s->members.back());
+    }
+    for (size_t i = 0; i < s->graveyard.size(); ++i) {
+        connection* c = s->graveyard[i];
+        while (!c->out.empty()) {
+            put_message(c->out.front());
+            c->out.pop_front();
+        }
+        delete c;
+    }
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc <= 2) {
+        printf("usage: %s ip_address port_number [shards]\n",
+               basename(argv[0]));
+        return 1;
+    }
+    const char* ip = argv[1];
+    int port = atoi(argv[2]);
+    shard_count = (argc > 3) ? atoi(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN);
+    if ((shard_count < 1) || (shard_count > MAX_SHARDS)) {
+        shard_count = 1;
+    }
+
+    int ret = 0;
+    struct sockaddr_in address;
+    bzero(&address, sizeof(address));
+    address.sin_family = AF_INET;
+    inet_pton(AF_INET, ip, &address.sin_addr);
+    address.sin_port = htons(port);
+
+    listenfd = socket(PF_INET, SOCK_STREAM, 0);
+    assert(listenfd >= 0);
+
+    ret = bind(listenfd, (struct sockaddr*)&address, sizeof(address));
+    assert(ret != -1);
+
+    ret = listen(listenfd, SOMAXCONN);
+    assert(ret != -1);
+
+    epoll_event events[MAX_EVENT_NUMBER];
+    epollfd = epoll_create(5);
+    assert(epollfd != -1);
+    addfd(epollfd, listenfd);
+
+    // blocked before the shards start so no shard thread takes them
+    signals.add(SIGTERM);
+    signals.add(SIGINT);
+    addfd(epollfd, signals.fd());
+    addsig(SIGPIPE, SIG_IGN);
+
+    shards = new shard[shard_count];
+    for (int i = 0; i < shard_count; ++i) {
+        shard* s = &shards[i];
+        s->delivered = 0;
+        s->cut_off = 0;
+        s->epollfd = epoll_create(5);
+        assert(s->epollfd != -1);
+        s->wakefd = eventfd(0, EFD_NONBLOCK);
+        assert(s->wakefd != -1);
+        epoll_event event;
+        event.data.ptr = NULL;
+        event.events = EPOLLIN | EPOLLET;
+        epoll_ctl(s->epollfd, EPOLL_CTL_ADD, s->wakefd, &event);
+        ret = pthread_create(&s->tid, NULL, run_shard, s);
+        assert(ret == 0);
+    }
+    printf("chat room on %d shards\n", shard_count);
+
+    int next_shard = 0;
+    while (!stop_server) {
+        int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
+        if ((number < 0) && (errno != EINTR)) {
+            printf("epoll failure\n");
+            break;
+        }
+
+        for (int i = 0; i < number; i++) {
+            int sockfd = events[i].data.fd;
+            if (sockfd == listenfd) {
+                // edge triggered: accept until the queue is empty
+                while (true) {
+                    struct sockaddr_in client_address;
+                    socklen_t client_addrlength = sizeof(client_address);
+                    int connfd = accept4(
+                        listenfd, (struct sockaddr*)&client_address,
+                        &client_addrlength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (connfd < 0) {
+                        if ((errno == ECONNABORTED) || (errno == EINTR)) {
+                            continue;
+                        }
+                        if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                            printf("errno is: %d\n", errno);
+                        }
+                        break;
+                    }
+                    shard* s = &shards[next_shard];
+                    next_shard = (next_shard + 1) % shard_count;
+                    s->lock.lock();
+                    s->new_fds.push_back(connfd);
+                    s->lock.unlock();
+                    wake(s);
+                }
+            } else if ((sockfd == signals.fd()) &&
+                       (events[i].events & EPOLLIN)) {
+                while (signals.read_batch() > 0) {
+                    for (int j = 0; j < signals.count(); ++j) {
+                        int sig = signals.info(j).ssi_signo;
+                        if ((sig == SIGTERM) || (sig == SIGINT)) {
+                            stop_server = true;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    long delivered = 0, cut_off = 0;
+    for (int i = 0; i < shard_count; ++i) {
+        wake(&shards[i]);
+        pthread_join(shards[i].tid, NULL);
+        delivered += shards[i].delivered;
+        cut_off += shards[i].cut_off;
+        close(shards[i].wakefd);
+        close(shards[i].epollfd);
+    }
+    printf("delivered %ld messages, cut off %ld slow readers\n", delivered,
+           cut_off);
+    delete[] shards;
+    close(listenfd);
+    close(epollfd);
+    return 0;
+}
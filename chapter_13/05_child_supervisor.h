@@ -0,0 +1,154 @@
+#ifndef CHILD_SUPERVISOR_H
+#define CHILD_SUPERVISOR_H
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <exception>
+
+// Child exits as fd events instead of SIGCHLD. Every watched child gets a
+// pidfd (Linux 5.3+) in a private epoll set whose data is the caller's own
+// index for that child, so an exit names its slot directly: no
+// waitpid(-1) loop and no pid -> slot lookup. fd() is one descriptor for
+// the caller's main epoll set, readable while any watched child has exited.
+//
+// A pidfd is always close-on-exec but survives fork. A forked child that
+// keeps running the same code calls release() to drop its copies.
+class child_supervisor {
+public:
+    static const int MAX_BATCH = 64;
+
+public:
+    child_supervisor(int capacity)
+        : m_capacity(capacity), m_ready(0), m_next(0) {
+        m_epollfd = epoll_create1(EPOLL_CLOEXEC);
+        if (m_epollfd == -1) {
+            throw std::exception();
+        }
+        m_pid = new pid_t[capacity];
+        m_pidfd = new int[capacity];
+        for (int i = 0; i < capacity; ++i) {
+            m_pid[i] = -1;
+            m_pidfd[i] = -1;
+        }
+    }
+
+    ~child_supervisor() {
+        release();
+        delete[] m_pid;
+        delete[] m_pidfd;
+    }
+
+    // start watching pid under slot idx; false if the kernel has no pidfds
+    bool watch(int idx, pid_t pid) {
+        int pidfd = syscall(SYS_pidfd_open, pid, 0);
+        if (pidfd == -1) {
+            return false;
+        }
+        epoll_event event;
+        event.data.u64 = 0;
+        event.data.u32 = idx;
+        event.events = EPOLLIN;
+        if (epoll_ctl(m_epollfd, EPOLL_CTL_ADD, pidfd, &event) == -1) {
+            close(pidfd);
+            return false;
+        }
+        m_pid[idx] = pid;
+        m_pidfd[idx] = pidfd;
+        return true;
+    }
+
+    // the caller compacted its table: the child in slot from now lives in
+    // slot to
+    void move(int from, int to) {
+        if (from == to) {
+            return;
+        }
+        m_pid[to] = m_pid[from];
+        m_pidfd[to] = m_pidfd[from];
+        m_pid[from] = -1;
+        m_pidfd[from] = -1;
+        if (m_pidfd[to] != -1) {
+            epoll_event event;
+            event.data.u64 = 0;
+            event.data.u32 = to;
+            event.events = EPOLLIN;
+            epoll_ctl(m_epollfd, EPOLL_CTL_MOD, m_pidfd[to], &event);
+        }
+    }
+
+    // reaps one exited child and returns its slot, -1 once none is left;
+    // call until -1, fd() is edge triggered in the caller's set
+    int next_exit(int* status) {
+        while (true) {
+            if (m_next == m_ready) {
+                m_next = 0;
+                m_ready = epoll_wait(m_epollfd, m_events, MAX_BATCH, 0);
+                if (m_ready <= 0) {
+                    m_ready = 0;
+                    return -1;
+                }
+            }
+            int idx = m_events[m_next++].data.u32;
+            // a slot moved or forgotten since this batch was read; a live
+            // pidfd reports again on the next epoll_wait
+            if ((idx >= m_capacity) || (m_pidfd[idx] == -1)) {
+                continue;
+            }
+            pid_t ret;
+            do {
+                ret = waitpid(m_pid[idx], status, WNOHANG);
+            } while ((ret < 0) && (errno == EINTR));
+            if (ret == 0) {
+                continue;
+            }
+            forget(idx);
+            return idx;
+        }
+    }
+
+    pid_t pid(int idx) const { return m_pid[idx]; }
+
+    int fd() const { return m_epollfd; }
+
+    // drops every descriptor without reaping, for a forked child
+    void release() {
+        for (int i = 0; i < m_capacity; ++i) {
+            if (m_pidfd[i] != -1) {
+                close(m_pidfd[i]);
+                m_pidfd[i] = -1;
+                m_pid[i] = -1;
+            }
+        }
+        if (m_epollfd != -1) {
+            close(m_epollfd);
+            m_epollfd = -1;
+        }
+        m_ready = m_next = 0;
+    }
+
+private:
+    void forget(int idx) {
+        // a forked child may still hold the pidfd open, so deregister
+        // explicitly rather than relying on close()
+        epoll_ctl(m_epollfd, EPOLL_CTL_DEL, m_pidfd[idx], 0);
+        close(m_pidfd[idx]);
+        m_pidfd[idx] = -1;
+        m_pid[idx] = -1;
+    }
+
+private:
+    int m_epollfd;
+    int m_capacity;
+    pid_t* m_pid;
+    int* m_pidfd;
+    epoll_event m_events[MAX_BATCH];
+    int m_ready;
+    int m_next;
+};
+
+#endif
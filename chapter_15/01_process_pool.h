@@ -5,27 +5,64 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <atomic>
+
+#include "child_supervisor.h"
+#include "conn_table.h"
+#include "signal_source.h"
+#include "socket_policy.h"
+
+static const char* LISTEN_FD_ENV = "PROCESSPOOL_LISTEN_FD";
+static const char* UPGRADE_FROM_ENV = "PROCESSPOOL_UPGRADE_FROM";
+
 class process {
 public:
-    process() : m_pid(-1) {}
+    process()
+        : m_pid(-1),
+          m_dispatched(0),
+          m_backoff_ms(0),
+          m_respawn_at(0),
+          m_started_at(0) {}
 
 public:
     pid_t m_pid;
     int m_pipefd[2];
+    long m_dispatched;
+    long m_backoff_ms;
+    long m_respawn_at;
+    long m_started_at;
 };
 
+// One slot per child in a MAP_SHARED page: the child publishes, the parent
+// reads when choosing where a new connection goes.
+struct process_stat {
+    std::atomic<int> m_conns;
+    std::atomic<long> m_notified;
+    std::atomic<long> m_accepted;
+    std::atomic<long> m_lag_us;
+    std::atomic<int> m_restarts;
+    // what the child's connection table holds, slabs and map
+    std::atomic<long> m_conn_bytes;
+};
+
+enum DISPATCH_POLICY { ROUND_ROBIN = 0, LEAST_LOADED, TWO_CHOICES };
+
 template <typename T>
 class processpool {
 private:
@@ -39,32 +76,80 @@ public:
         return m_instance;
     }
 
-    ~processpool() { delete[] m_sub_process; }
+    ~processpool() {
+        delete[] m_sub_process;
+        munmap(m_stat, sizeof(process_stat) * MAX_PROCESS_NUMBER);
+    }
 
     void run();
 
+    void set_dispatch(DISPATCH_POLICY policy) { m_policy = policy; }
+
+    // parent accepts and ships the fds to children over SCM_RIGHTS
+    void set_fd_passing(bool on) { m_pass_fd = on; }
+
+    // the listening socket handed down by a predecessor on SIGUSR2, -1 on
+    // a cold start
+    static int inherited_listenfd() {
+        const char* env = getenv(LISTEN_FD_ENV);
+        if (!env) {
+            return -1;
+        }
+        int fd = atoi(env);
+        unsetenv(LISTEN_FD_ENV);
+        return fd;
+    }
+
 private:
-    void setup_sig_pipe();
+    void setup_signals();
     void run_parent();
     void run_child();
+    int pick_child(int& rr_counter);
+    void accept_and_pass(int& rr_counter);
+    void notify_children(int& rr_counter);
+    void pass_batch(int c, int* fds, sockaddr_in* addrs, int k);
+    void recv_conns(int pipefd, conn_table<T>* users);
+    pid_t spawn_successor();
+    void child_exited(int idx, int status);
+    void respawn(int idx);
+    int respawn_timeout();
+    void start_drain();
+    long load(int idx) const;
 
 private:
     static const int MAX_PROCESS_NUMBER = 16;
     static const int USER_PER_PROCESS = 65536;
     static const int MAX_EVENT_NUMBER = 10000;
+    static const int MAX_ACCEPT_BATCH = 1024;
+    static const int PASS_WAIT_MS = 100;
+    static const int DRAIN_TIMEOUT = 30;
+    static const long MIN_BACKOFF_MS = 10;
+    static const long MAX_BACKOFF_MS = 5000;
+    static const long STABLE_MS = 10000;
     int m_process_number;
     int m_idx;
     int m_epollfd;
     int m_listenfd;
     int m_stop;
     process* m_sub_process;
+    // slot i is m_sub_process[i], slot m_process_number the upgrade process
+    child_supervisor m_children;
+    process_stat* m_stat;
+    DISPATCH_POLICY m_policy;
+    bool m_pass_fd;
+    bool m_draining;
+    bool m_terminating;
+    // queued connections no child could be told about yet
+    bool m_backlog_waiting;
+    pid_t m_upgrade_pid;
     static processpool<T>* m_instance;
 };
 
 template <typename T>
 processpool<T>* processpool<T>::m_instance = NULL;
 
-static int sig_pipefd[2];
+static signal_source sig_source;
+static const int MAX_FDS_PER_MSG = 64;
 
 static int setnonblocking(int fd) {
     int old_option = fcntl(fd, F_GETFL);
@@ -86,11 +171,80 @@ static void removefd(int epollfd, int fd) {
     close(fd);
 }
 
-static void sig_handler(int sig) {
-    int save_errno = errno;
-    int msg = sig;
-    send(sig_pipefd[1], (char*)&msg, 1, 0);
-    errno = save_errno;
+// batched variant of send_fd()/recv_fd() from chapter_13: n descriptors in
+// one SCM_RIGHTS message, their peer addresses as the payload
+static int send_fds(int sock, const int* fds, const sockaddr_in* addrs,
+                    int n) {
+    struct iovec iov[1];
+    struct msghdr msg;
+    char control[CMSG_SPACE(sizeof(int) * MAX_FDS_PER_MSG)];
+    if ((n <= 0) || (n > MAX_FDS_PER_MSG)) {
+        return -1;
+    }
+
+    iov[0].iov_base = (void*)addrs;
+    iov[0].iov_len = sizeof(sockaddr_in) * n;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+
+    struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_len = CMSG_LEN(sizeof(int) * n);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    memcpy(CMSG_DATA(cm), fds, sizeof(int) * n);
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL);
+}
+
+static int recv_fds(int sock, int* fds, sockaddr_in* addrs, int max) {
+    struct iovec iov[1];
+    struct msghdr msg;
+    char control[CMSG_SPACE(sizeof(int) * MAX_FDS_PER_MSG)];
+
+    iov[0].iov_base = addrs;
+    iov[0].iov_len = sizeof(sockaddr_in) * max;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    int n = 0;
+    struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+    if (cm && (cm->cmsg_level == SOL_SOCKET) &&
+        (cm->cmsg_type == SCM_RIGHTS)) {
+        n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cm), sizeof(int) * n);
+    }
+    if ((msg.msg_flags & MSG_CTRUNC) ||
+        (n != ret / (int)sizeof(sockaddr_in))) {
+        for (int i = 0; i < n; ++i) {
+            close(fds[i]);
+        }
+        errno = EPROTO;
+        return -1;
+    }
+    return n;
+}
+
+static long monotonic_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static time_t monotonic_deadline(int secs) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + secs;
 }
 
 static void addsig(int sig, void(handler)(int), bool restart = true) {
@@ -109,24 +263,45 @@ processpool<T>::processpool(int listenfd, int process_number)
     : m_listenfd(listenfd),
       m_process_number(process_number),
       m_idx(-1),
-      m_stop(false) {
+      m_stop(false),
+      m_children(process_number + 1),
+      m_policy(LEAST_LOADED),
+      m_pass_fd(false),
+      m_draining(false),
+      m_terminating(false),
+      m_backlog_waiting(false),
+      m_upgrade_pid(-1) {
     assert((process_number > 0) && (process_number <= MAX_PROCESS_NUMBER));
 
+    void* page = mmap(NULL, sizeof(process_stat) * MAX_PROCESS_NUMBER,
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1,
+                      0);
+    assert(page != MAP_FAILED);
+    // anonymous mappings start zeroed, which is every counter's initial value
+    m_stat = (process_stat*)page;
+
     m_sub_process = new process[process_number];
     assert(m_sub_process);
 
     for (int i = 0; i < process_number; ++i) {
+        // SEQPACKET keeps each batch of passed fds in its own record
         int ret =
-            socketpair(PF_UNIX, SOCK_STREAM, 0, m_sub_process[i].m_pipefd);
+            socketpair(PF_UNIX, SOCK_SEQPACKET, 0, m_sub_process[i].m_pipefd);
         assert(ret == 0);
 
         m_sub_process[i].m_pid = fork();
         assert(m_sub_process[i].m_pid >= 0);
         if (m_sub_process[i].m_pid > 0) {
             close(m_sub_process[i].m_pipefd[1]);
+            // a child slow to read must not stall dispatch to the others
+            setnonblocking(m_sub_process[i].m_pipefd[0]);
+            m_sub_process[i].m_started_at = monotonic_ms();
+            bool watched = m_children.watch(i, m_sub_process[i].m_pid);
+            assert(watched);
             continue;
         } else {
             close(m_sub_process[i].m_pipefd[0]);
+            m_children.release();
             m_idx = i;
             break;
         }
@@ -134,19 +309,20 @@ processpool<T>::processpool(int listenfd, int process_number)
 }
 
 template <typename T>
-void processpool<T>::setup_sig_pipe() {
+void processpool<T>::setup_signals() {
     m_epollfd = epoll_create(5);
     assert(m_epollfd != -1);
 
-    int ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sig_pipefd);
-    assert(ret != -1);
-
-    setnonblocking(sig_pipefd[1]);
-    addfd(m_epollfd, sig_pipefd[0]);
-
-    addsig(SIGCHLD, sig_handler);
-    addsig(SIGTERM, sig_handler);
-    addsig(SIGINT, sig_handler);
+    // the parent learns about its children from m_children instead
+    if (m_idx != -1) {
+        sig_source.add(SIGCHLD);
+    }
+    sig_source.add(SIGTERM);
+    sig_source.add(SIGINT);
+    sig_source.add(SIGUSR2);
+    sig_source.add(SIGWINCH);
+    sig_source.add(SIGQUIT);
+    addfd(m_epollfd, sig_source.fd());
     addsig(SIGPIPE, SIG_IGN);
 }
 
@@ -161,54 +337,77 @@ void processpool<T>::run() {
 
 template <typename T>
 void processpool<T>::run_child() {
-    setup_sig_pipe();
+    setup_signals();
 
     int pipefd = m_sub_process[m_idx].m_pipefd[1];
     addfd(m_epollfd, pipefd);
 
     epoll_event events[MAX_EVENT_NUMBER];
-    T* users = new T[USER_PER_PROCESS];
-    assert(users);
+    conn_table<T>* users = new conn_table<T>(USER_PER_PROCESS);
+    process_stat& stat = m_stat[m_idx];
     int number = 0;
     int ret = -1;
+    time_t drain_deadline = 0;
 
     while (!m_stop) {
-        number = epoll_wait(m_epollfd, events, MAX_EVENT_NUMBER, -1);
+        number = epoll_wait(m_epollfd, events, MAX_EVENT_NUMBER,
+                            m_draining ? 1000 : -1);
         if ((number < 0) && (errno != EINTR)) {
             printf("epoll failure\n");
             break;
         }
+        struct timespec begin;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
 
         for (int i = 0; i < number; i++) {
             int sockfd = events[i].data.fd;
-            if ((sockfd == pipefd) && (events[i].events & EPOLLIN)) {
+            if ((sockfd == pipefd) && (events[i].events & EPOLLIN) &&
+                m_pass_fd) {
+                recv_conns(pipefd, users);
+            } else if ((sockfd == pipefd) && (events[i].events & EPOLLIN)) {
+                // one notification per queued connection, one accept each;
+                // the pipe is edge triggered, so take all that are waiting
                 int client = 0;
-                ret = recv(sockfd, (char*)&client, sizeof(client), 0);
-                if (((ret < 0) && (errno != EAGAIN)) || ret == 0) {
-                    continue;
-                } else {
+                while (true) {
+                    ret = recv(sockfd, (char*)&client, sizeof(client), 0);
+                    if ((ret < 0) && (errno == EINTR)) {
+                        continue;
+                    }
+                    if (ret <= 0) {
+                        break;
+                    }
+                    stat.m_notified++;
                     struct sockaddr_in client_address;
                     socklen_t client_addrlength = sizeof(client_address);
-                    int connfd =
-                        accept(m_listenfd, (struct sockaddr*)&client_address,
-                               &client_addrlength);
+                    int connfd;
+                    do {
+                        connfd = accept4(
+                            m_listenfd, (struct sockaddr*)&client_address,
+                            &client_addrlength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    } while ((connfd < 0) &&
+                             ((errno == ECONNABORTED) || (errno == EINTR)));
                     if (connfd < 0) {
-                        printf("errno is: %d\n", errno);
+                        // EAGAIN: the parent counted one too many
+                        if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                            printf("errno is: %d\n", errno);
+                        }
+                        continue;
+                    }
+                    T* conn = users->open(connfd);
+                    if (!conn) {
+                        close(connfd);
                         continue;
                     }
                     addfd(m_epollfd, connfd);
-                    users[connfd].init(m_epollfd, connfd, client_address);
+                    conn->init(m_epollfd, connfd, client_address);
+                    stat.m_conns++;
+                    stat.m_accepted++;
                 }
-            } else if ((sockfd == sig_pipefd[0]) &&
+            } else if ((sockfd == sig_source.fd()) &&
                        (events[i].events & EPOLLIN)) {
-                int sig;
-                char signals[1024];
-                ret = recv(sig_pipefd[0], signals, sizeof(signals), 0);
-                if (ret <= 0) {
-                    continue;
-                } else {
-                    for (int i = 0; i < ret; ++i) {
-                        switch (signals[i]) {
+                while (sig_source.read_batch() > 0) {
+                    for (int i = 0; i < sig_source.count(); ++i) {
+                        switch (sig_source.info(i).ssi_signo) {
                             case SIGCHLD: {
                                 pid_t pid;
                                 int stat;
@@ -223,6 +422,12 @@ void processpool<T>::run_child() {
                                 m_stop = true;
                                 break;
                             }
+                            case SIGQUIT: {
+                                // a successor owns the listener now
+                                m_draining = true;
+                                drain_deadline = monotonic_deadline(DRAIN_TIMEOUT);
+                                break;
+                            }
                             default: {
                                 break;
                             }
@@ -230,14 +435,36 @@ void processpool<T>::run_child() {
                     }
                 }
             } else if (events[i].events & EPOLLIN) {
-                users[sockfd].process();
+                T* conn = users->get(sockfd);
+                if (!conn) {
+                    continue;
+                }
+                conn->process();
+                // T closes its own socket; a dead fd means one fewer client
+                if ((fcntl(sockfd, F_GETFD) == -1) && (errno == EBADF)) {
+                    users->close(sockfd);
+                    stat.m_conns--;
+                }
             } else {
                 continue;
             }
         }
+
+        // time spent serving this batch, smoothed as lag = 7/8 lag + 1/8 now
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        long us = (end.tv_sec - begin.tv_sec) * 1000000 +
+                  (end.tv_nsec - begin.tv_nsec) / 1000;
+        stat.m_lag_us = stat.m_lag_us - stat.m_lag_us / 8 + us / 8;
+        stat.m_conn_bytes = users->bytes();
+
+        if (m_draining &&
+            ((stat.m_conns <= 0) || (end.tv_sec >= drain_deadline))) {
+            m_stop = true;
+        }
     }
 
-    delete[] users;
+    delete users;
     users = NULL;
     close(pipefd);
     // close( m_listenfd );
@@ -246,79 +473,82 @@ void processpool<T>::run_child() {
 
 template <typename T>
 void processpool<T>::run_parent() {
-    setup_sig_pipe();
+    setup_signals();
+
+    const char* predecessor = getenv(UPGRADE_FROM_ENV);
+    if (predecessor) {
+        kill(atoi(predecessor), SIGWINCH);
+        unsetenv(UPGRADE_FROM_ENV);
+    }
 
     addfd(m_epollfd, m_listenfd);
+    addfd(m_epollfd, m_children.fd());
 
     epoll_event events[MAX_EVENT_NUMBER];
     int sub_process_counter = 0;
-    int new_conn = 1;
     int number = 0;
     int ret = -1;
 
     while (!m_stop) {
-        number = epoll_wait(m_epollfd, events, MAX_EVENT_NUMBER, -1);
+        int timeout = respawn_timeout();
+        if (m_backlog_waiting &&
+            ((timeout == -1) || (timeout > PASS_WAIT_MS))) {
+            timeout = PASS_WAIT_MS;
+        }
+        number = epoll_wait(m_epollfd, events, MAX_EVENT_NUMBER, timeout);
         if ((number < 0) && (errno != EINTR)) {
             printf("epoll failure\n");
             break;
         }
 
+        long now = monotonic_ms();
+        for (int i = 0; i < m_process_number; ++i) {
+            if ((m_sub_process[i].m_pid == -1) &&
+                (m_sub_process[i].m_respawn_at != 0) &&
+                (m_sub_process[i].m_respawn_at <= now)) {
+                respawn(i);
+                if (m_pass_fd) {
+                    accept_and_pass(sub_process_counter);
+                }
+            }
+        }
+        if (m_backlog_waiting && !m_pass_fd) {
+            notify_children(sub_process_counter);
+        }
+
         for (int i = 0; i < number; i++) {
             int sockfd = events[i].data.fd;
-            if (sockfd == m_listenfd) {
-                int i = sub_process_counter;
-                do {
+            if ((sockfd == m_listenfd) && m_pass_fd) {
+                accept_and_pass(sub_process_counter);
+            } else if (sockfd == m_listenfd) {
+                notify_children(sub_process_counter);
+            } else if ((sockfd == m_children.fd()) &&
+                       (events[i].events & EPOLLIN)) {
+                int idx;
+                int stat;
+                while ((idx = m_children.next_exit(&stat)) != -1) {
+                    if (idx == m_process_number) {
+                        printf("upgrade process %d exited\n", m_upgrade_pid);
+                        m_upgrade_pid = -1;
+                    } else {
+                        child_exited(idx, stat);
+                    }
+                }
+                m_stop = m_terminating || m_draining;
+                for (int i = 0; i < m_process_number; ++i) {
                     if (m_sub_process[i].m_pid != -1) {
-                        break;
+                        m_stop = false;
                     }
-                    i = (i + 1) % m_process_number;
-                } while (i != sub_process_counter);
-
-                if (m_sub_process[i].m_pid == -1) {
-                    m_stop = true;
-                    break;
                 }
-                sub_process_counter = (i + 1) % m_process_number;
-                // send( m_sub_process[sub_process_counter++].m_pipefd[0], (
-                // char* )&new_conn, sizeof( new_conn ), 0 );
-                send(m_sub_process[i].m_pipefd[0], (char*)&new_conn,
-                     sizeof(new_conn), 0);
-                printf("send request to child %d\n", i);
-                // sub_process_counter %= m_process_number;
-            } else if ((sockfd == sig_pipefd[0]) &&
+            } else if ((sockfd == sig_source.fd()) &&
                        (events[i].events & EPOLLIN)) {
-                int sig;
-                char signals[1024];
-                ret = recv(sig_pipefd[0], signals, sizeof(signals), 0);
-                if (ret <= 0) {
-                    continue;
-                } else {
-                    for (int i = 0; i < ret; ++i) {
-                        switch (signals[i]) {
-                            case SIGCHLD: {
-                                pid_t pid;
-                                int stat;
-                                while ((pid = waitpid(-1, &stat, WNOHANG)) >
-                                       0) {
-                                    for (int i = 0; i < m_process_number; ++i) {
-                                        if (m_sub_process[i].m_pid == pid) {
-                                            printf("child %d join\n", i);
-                                            close(m_sub_process[i].m_pipefd[0]);
-                                            m_sub_process[i].m_pid = -1;
-                                        }
-                                    }
-                                }
-                                m_stop = true;
-                                for (int i = 0; i < m_process_number; ++i) {
-                                    if (m_sub_process[i].m_pid != -1) {
-                                        m_stop = false;
-                                    }
-                                }
-                                break;
-                            }
+                while (sig_source.read_batch() > 0) {
+                    for (int i = 0; i < sig_source.count(); ++i) {
+                        switch (sig_source.info(i).ssi_signo) {
                             case SIGTERM:
                             case SIGINT: {
                                 printf("kill all the clild now\n");
+                                m_terminating = true;
                                 for (int i = 0; i < m_process_number; ++i) {
                                     int pid = m_sub_process[i].m_pid;
                                     if (pid != -1) {
@@ -327,6 +557,29 @@ void processpool<T>::run_parent() {
                                 }
                                 break;
                             }
+                            case SIGUSR2: {
+                                if ((m_upgrade_pid == -1) && !m_draining) {
+                                    m_upgrade_pid = spawn_successor();
+                                    if (m_upgrade_pid > 0) {
+                                        m_children.watch(m_process_number,
+                                                         m_upgrade_pid);
+                                    }
+                                    printf("upgrade started, pid %d\n",
+                                           m_upgrade_pid);
+                                }
+                                break;
+                            }
+                            case SIGWINCH: {
+                                // only meaningful from our own successor;
+                                // a terminal resize sends it to the whole
+                                // foreground process group
+                                pid_t from = sig_source.info(i).ssi_pid;
+                                if ((m_upgrade_pid != -1) &&
+                                    (from == m_upgrade_pid) && !m_draining) {
+                                    start_drain();
+                                }
+                                break;
+                            }
                             default: {
                                 break;
                             }
@@ -339,8 +592,406 @@ void processpool<T>::run_parent() {
         }
     }
 
+    for (int i = 0; i < m_process_number; ++i) {
+        int conns = m_stat[i].m_conns.load();
+        long bytes = m_stat[i].m_conn_bytes.load();
+        printf("child %d: %d conns in %ld bytes (%ld per conn), %ld accepted, "
+               "%ld us loop lag, %d restarts\n",
+               i, conns, bytes, (conns > 0) ? bytes / conns : 0,
+               m_stat[i].m_accepted.load(), m_stat[i].m_lag_us.load(),
+               m_stat[i].m_restarts.load());
+    }
     // close( m_listenfd );
     close(m_epollfd);
 }
 
+// A crashed child is re-forked after a backoff that doubles with every
+// crash and resets once a child has stayed up for STABLE_MS.
+template <typename T>
+void processpool<T>::child_exited(int idx, int status) {
+    process& child = m_sub_process[idx];
+    if (WIFSIGNALED(status)) {
+        printf("child %d join, killed by signal %d\n", idx, WTERMSIG(status));
+    } else {
+        printf("child %d join, exit status %d\n", idx, WEXITSTATUS(status));
+    }
+    close(child.m_pipefd[0]);
+    child.m_pid = -1;
+    child.m_respawn_at = 0;
+    if (m_terminating || m_draining) {
+        return;
+    }
+
+    long now = monotonic_ms();
+    if (now - child.m_started_at >= STABLE_MS) {
+        child.m_backoff_ms = MIN_BACKOFF_MS;
+    } else if (child.m_backoff_ms < MAX_BACKOFF_MS) {
+        child.m_backoff_ms = (child.m_backoff_ms == 0)
+                                 ? MIN_BACKOFF_MS
+                                 : child.m_backoff_ms * 2;
+        if (child.m_backoff_ms > MAX_BACKOFF_MS) {
+            child.m_backoff_ms = MAX_BACKOFF_MS;
+        }
+    }
+    child.m_respawn_at = now + child.m_backoff_ms;
+}
+
+template <typename T>
+int processpool<T>::respawn_timeout() {
+    long next = 0;
+    for (int i = 0; i < m_process_number; ++i) {
+        long at = m_sub_process[i].m_respawn_at;
+        if ((m_sub_process[i].m_pid == -1) && at && (!next || at < next)) {
+            next = at;
+        }
+    }
+    if (!next) {
+        return -1;
+    }
+    long wait = next - monotonic_ms();
+    return (wait > 0) ? wait : 0;
+}
+
+template <typename T>
+void processpool<T>::respawn(int idx) {
+    process& child = m_sub_process[idx];
+    child.m_respawn_at = 0;
+    if (socketpair(PF_UNIX, SOCK_SEQPACKET, 0, child.m_pipefd) != 0) {
+        child.m_respawn_at = monotonic_ms() + child.m_backoff_ms;
+        return;
+    }
+
+    m_stat[idx].m_conns = 0;
+    m_stat[idx].m_notified = 0;
+    m_stat[idx].m_lag_us = 0;
+    m_stat[idx].m_conn_bytes = 0;
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(child.m_pipefd[0]);
+        close(child.m_pipefd[1]);
+        child.m_respawn_at = monotonic_ms() + child.m_backoff_ms;
+        return;
+    } else if (pid > 0) {
+        close(child.m_pipefd[1]);
+        setnonblocking(child.m_pipefd[0]);
+        child.m_pid = pid;
+        child.m_dispatched = 0;
+        child.m_started_at = monotonic_ms();
+        m_stat[idx].m_restarts++;
+        bool watched = m_children.watch(idx, pid);
+        assert(watched);
+        printf("child %d respawned as %d\n", idx, pid);
+        return;
+    }
+
+    // the new child starts from a clean slate: none of the parent's fds
+    close(m_epollfd);
+    m_children.release();
+    sig_source.reopen();
+    for (int i = 0; i < m_process_number; ++i) {
+        if ((i != idx) && (m_sub_process[i].m_pid != -1)) {
+            close(m_sub_process[i].m_pipefd[0]);
+        }
+    }
+    close(child.m_pipefd[0]);
+    m_idx = idx;
+    m_stop = false;
+    run_child();
+    exit(0);
+}
+
+// fork + exec the current binary with m_listenfd left open across exec; the
+// new master reports back with SIGWINCH once its pool is running
+template <typename T>
+pid_t processpool<T>::spawn_successor() {
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+
+    char exe[PATH_MAX];
+    char cmdline[4096];
+    char* argv[64];
+    int exe_len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if (exe_len <= 0) {
+        _exit(1);
+    }
+    exe[exe_len] = '\0';
+    int fd = open("/proc/self/cmdline", O_RDONLY);
+    int len = (fd < 0) ? -1 : read(fd, cmdline, sizeof(cmdline) - 1);
+    if (len <= 0) {
+        _exit(1);
+    }
+    close(fd);
+    cmdline[len] = '\0';
+    int argc = 0;
+    for (int pos = 0; (pos < len) && (argc < 63);
+         pos += strlen(cmdline + pos) + 1) {
+        argv[argc++] = cmdline + pos;
+    }
+    argv[argc] = NULL;
+
+    close(m_epollfd);
+    // the blocked mask would otherwise carry over into the new master
+    sig_source.unblock();
+    for (int i = 0; i < m_process_number; ++i) {
+        if (m_sub_process[i].m_pid != -1) {
+            close(m_sub_process[i].m_pipefd[0]);
+        }
+    }
+
+    char buf[16];
+    fcntl(m_listenfd, F_SETFD, 0);
+    snprintf(buf, sizeof(buf), "%d", m_listenfd);
+    setenv(LISTEN_FD_ENV, buf, 1);
+    snprintf(buf, sizeof(buf), "%d", getppid());
+    setenv(UPGRADE_FROM_ENV, buf, 1);
+    execv(exe, argv);
+    _exit(1);
+}
+
+// stop accepting and let every child finish its live connections; the
+// parent leaves once the last child is reaped
+template <typename T>
+void processpool<T>::start_drain() {
+    printf("successor %d is up, draining\n", m_upgrade_pid);
+    m_draining = true;
+    epoll_ctl(m_epollfd, EPOLL_CTL_DEL, m_listenfd, 0);
+    for (int i = 0; i < m_process_number; ++i) {
+        if (m_sub_process[i].m_pid != -1) {
+            kill(m_sub_process[i].m_pid, SIGQUIT);
+        }
+    }
+}
+
+// Drain the accept queue, then send every child its share in as few
+// sendmsg calls as possible. The child never touches m_listenfd. The
+// listener is edge triggered, so this goes on batch after batch until
+// accept4 says EAGAIN.
+template <typename T>
+void processpool<T>::accept_and_pass(int& rr_counter) {
+    int probe = rr_counter;
+    if (pick_child(probe) == -1) {
+        // leave the backlog in the kernel until a child is respawned
+        return;
+    }
+
+    static int fds[MAX_ACCEPT_BATCH];
+    static sockaddr_in addrs[MAX_ACCEPT_BATCH];
+    static int owner[MAX_ACCEPT_BATCH];
+    bool more = true;
+    while (more) {
+        int n = 0;
+        more = false;
+        while (n < MAX_ACCEPT_BATCH) {
+            socklen_t len = sizeof(addrs[n]);
+            int connfd = accept4(m_listenfd, (struct sockaddr*)&addrs[n],
+                                 &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (connfd < 0) {
+                if ((errno == ECONNABORTED) || (errno == EINTR)) {
+                    continue;
+                }
+                if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                    printf("errno is: %d\n", errno);
+                }
+                break;
+            }
+            owner[n] = pick_child(rr_counter);
+            if (owner[n] == -1) {
+                // the last child died under us; the rest of the backlog
+                // waits for respawn(), which drains it again
+                close(connfd);
+                break;
+            }
+            m_sub_process[owner[n]].m_dispatched++;
+            fds[n++] = connfd;
+        }
+        more = (n == MAX_ACCEPT_BATCH);
+
+        int batch[MAX_FDS_PER_MSG];
+        sockaddr_in batch_addrs[MAX_FDS_PER_MSG];
+        for (int c = 0; c < m_process_number; ++c) {
+            int k = 0;
+            for (int j = 0; j <= n; ++j) {
+                if ((j < n) && (owner[j] == c)) {
+                    batch[k] = fds[j];
+                    batch_addrs[k++] = addrs[j];
+                }
+                if ((k == MAX_FDS_PER_MSG) || ((j == n) && (k > 0))) {
+                    pass_batch(c, batch, batch_addrs, k);
+                    k = 0;
+                }
+            }
+        }
+    }
+}
+
+// Without fd passing: one notification per connection in the accept queue
+// that no child has been told about, each to the child the policy picks;
+// the child accepts one connection per notification. The listener is edge
+// triggered, so whatever cannot be handed out now (every child down, or
+// its pipe full) is retried from run_parent() until it is.
+template <typename T>
+void processpool<T>::notify_children(int& rr_counter) {
+    int queued = 0;
+    int limit = 0;
+    accept_queue(m_listenfd, &queued, &limit);
+    long in_flight = 0;
+    for (int i = 0; i < m_process_number; ++i) {
+        long sent = m_sub_process[i].m_dispatched - m_stat[i].m_notified;
+        if ((m_sub_process[i].m_pid != -1) && (sent > 0)) {
+            in_flight += sent;
+        }
+    }
+
+    int new_conn = 1;
+    m_backlog_waiting = false;
+    for (long k = in_flight; k < queued; ++k) {
+        int i = pick_child(rr_counter);
+        if (i == -1) {
+            m_backlog_waiting = true;
+            return;
+        }
+        int ret;
+        do {
+            ret = send(m_sub_process[i].m_pipefd[0], (char*)&new_conn,
+                       sizeof(new_conn), 0);
+        } while ((ret < 0) && (errno == EINTR));
+        if (ret < 0) {
+            printf("notify child %d failed, errno is: %d\n", i, errno);
+            m_backlog_waiting = true;
+            return;
+        }
+        m_sub_process[i].m_dispatched++;
+        printf("send request to child %d\n", i);
+    }
+}
+
+// One sendmsg to child c; if its pipe is full or it is gone, the batch goes
+// to the next live child instead. When every pipe is full the parent waits
+// up to PASS_WAIT_MS for one to drain; only then, or with no child left,
+// are the connections closed.
+template <typename T>
+void processpool<T>::pass_batch(int c, int* fds, sockaddr_in* addrs, int k) {
+    while (true) {
+        struct pollfd full[MAX_PROCESS_NUMBER];
+        int nfull = 0;
+        for (int t = 0; t < m_process_number; ++t) {
+            int i = (c + t) % m_process_number;
+            if (m_sub_process[i].m_pid == -1) {
+                continue;
+            }
+            int ret;
+            do {
+                ret = send_fds(m_sub_process[i].m_pipefd[0], fds, addrs, k);
+            } while ((ret < 0) && (errno == EINTR));
+            if (ret >= 0) {
+                if (i != c) {
+                    m_sub_process[c].m_dispatched -= k;
+                    m_sub_process[i].m_dispatched += k;
+                }
+                // the child holds its own copies now
+                for (int m = 0; m < k; ++m) {
+                    close(fds[m]);
+                }
+                return;
+            }
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                full[nfull].fd = m_sub_process[i].m_pipefd[0];
+                full[nfull].events = POLLOUT;
+                full[nfull++].revents = 0;
+            } else {
+                printf("pass %d fds to child %d failed, errno is: %d\n", k,
+                       i, errno);
+            }
+        }
+        if ((nfull == 0) || (poll(full, nfull, PASS_WAIT_MS) <= 0)) {
+            break;
+        }
+    }
+    printf("no child took %d connections, closing them\n", k);
+    m_sub_process[c].m_dispatched -= k;
+    for (int m = 0; m < k; ++m) {
+        close(fds[m]);
+    }
+}
+
+template <typename T>
+void processpool<T>::recv_conns(int pipefd, conn_table<T>* users) {
+    process_stat& stat = m_stat[m_idx];
+    int fds[MAX_FDS_PER_MSG];
+    sockaddr_in addrs[MAX_FDS_PER_MSG];
+    while (true) {
+        int n = recv_fds(pipefd, fds, addrs, MAX_FDS_PER_MSG);
+        if (n < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                break;
+            }
+            if (errno == EPROTO) {
+                continue;
+            }
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        stat.m_notified += n;
+        stat.m_accepted += n;
+        stat.m_conns += n;
+        for (int i = 0; i < n; ++i) {
+            T* conn = users->open(fds[i]);
+            if (!conn) {
+                close(fds[i]);
+                stat.m_conns--;
+                continue;
+            }
+            addfd(m_epollfd, fds[i]);
+            conn->init(m_epollfd, fds[i], addrs[i]);
+        }
+    }
+}
+
+// Live connections plus the ones sent but not yet accepted, so a burst does
+// not all land on the child that looked idlest before it. Loop lag is
+// weighted in at one connection per millisecond.
+template <typename T>
+long processpool<T>::load(int idx) const {
+    long in_flight = m_sub_process[idx].m_dispatched - m_stat[idx].m_notified;
+    if (in_flight < 0) {
+        in_flight = 0;
+    }
+    return m_stat[idx].m_conns + in_flight + m_stat[idx].m_lag_us / 1000;
+}
+
+template <typename T>
+int processpool<T>::pick_child(int& rr_counter) {
+    int live[MAX_PROCESS_NUMBER];
+    int n = 0;
+    for (int k = 0; k < m_process_number; ++k) {
+        int i = (rr_counter + k) % m_process_number;
+        if (m_sub_process[i].m_pid != -1) {
+            live[n++] = i;
+        }
+    }
+    if (n == 0) {
+        return -1;
+    }
+
+    int chosen = live[0];
+    if (m_policy == LEAST_LOADED) {
+        for (int k = 1; k < n; ++k) {
+            if (load(live[k]) < load(chosen)) {
+                chosen = live[k];
+            }
+        }
+    } else if (m_policy == TWO_CHOICES) {
+        int a = live[rand() % n];
+        int b = live[rand() % n];
+        chosen = (load(b) < load(a)) ? b : a;
+    }
+    rr_counter = (chosen + 1) % m_process_number;
+    return chosen;
+}
+
 #endif
@@ -15,10 +15,17 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "cgi_frame.h"
+#include "signal_source.h"
+
 #define BUFFER_SIZE 1024
 #define MAX_EVENT_NUMBER 1024
 #define PROCESS_COUNT 5
 #define USER_PER_PROCESS 65535
+// persistent mode: long-lived CGI workers per pool process, see cgi_frame.h
+#define CGI_WORKER_COUNT 4
+#define CGI_MAX_REQUESTS 1000
+#define CGI_QUEUE_SIZE 256
 
 struct process_in_pool {
     pid_t pid;
@@ -31,12 +38,43 @@ struct client_data {
     int read_idx;
 };
 
-int sig_pipefd[2];
+signal_source signals;
 int epollfd;
 int listenfd;
 process_in_pool sub_process[PROCESS_COUNT];
 bool stop_child = false;
 
+struct cgi_worker {
+    pid_t pid;
+    int fd;  // our end of the channel, -1 for an empty slot
+    char program[BUFFER_SIZE];
+    int client;  // -1 while idle
+    // the client went away mid-request: the rest of its output is read
+    // and dropped, and the worker takes the next request after CGI_END
+    bool discarding;
+    unsigned short request_id;
+    int served;
+    // output the client could not take yet; the channel is not read until
+    // it drains, so a slow client backs up into the worker
+    char pending[CGI_MAX_FRAME];
+    int pending_len;
+    int pending_off;
+    // the frame being read into pending; a worker that stalls mid-frame
+    // must not block the other clients of this process
+    cgi_frame_reader reader;
+};
+
+struct cgi_request {
+    int client;
+    char program[BUFFER_SIZE];
+};
+
+bool persistent_cgi = false;
+cgi_worker cgi_workers[CGI_WORKER_COUNT];
+cgi_request cgi_queue[CGI_QUEUE_SIZE];
+int cgi_queue_head = 0;
+int cgi_queue_len = 0;
+
 int setnonblocking(int fd) {
     int old_option = fcntl(fd, F_GETFL);
     int new_option = old_option | O_NONBLOCK;
@@ -52,13 +90,6 @@ void addfd(int epollfd, int fd) {
     setnonblocking(fd);
 }
 
-void sig_handler(int sig) {
-    int save_errno = errno;
-    int msg = sig;
-    send(sig_pipefd[1], (char*)&msg, 1, 0);
-    errno = save_errno;
-}
-
 void addsig(int sig, void (*handler)(int), bool restart = true) {
     struct sigaction sa;
     memset(&sa, '\0', sizeof(sa));
@@ -71,8 +102,6 @@ void addsig(int sig, void (*handler)(int), bool restart = true) {
 }
 
 void del_resource() {
-    close(sig_pipefd[0]);
-    close(sig_pipefd[1]);
     close(listenfd);
     close(epollfd);
 }
@@ -87,11 +116,273 @@ void child_child_handler(int sig) {
     }
 }
 
+void close_client(int fd) {
+    // keep lingering output, we will not touch the socket again
+    shutdown(fd, SHUT_RDWR);
+    close(fd);
+}
+
+void retire_worker(int child_epollfd, cgi_worker* w) {
+    epoll_ctl(child_epollfd, EPOLL_CTL_DEL, w->fd, 0);
+    // the worker sees EOF in cgi_accept() and exits, SIGCHLD reaps it
+    close(w->fd);
+    if (w->client != -1) {
+        epoll_ctl(child_epollfd, EPOLL_CTL_DEL, w->client, 0);
+        close_client(w->client);
+    }
+    w->pid = -1;
+    w->fd = -1;
+    w->client = -1;
+    w->discarding = false;
+    w->pending_len = 0;
+    w->pending_off = 0;
+    w->reader.got = 0;
+}
+
+bool spawn_worker(int child_epollfd, cgi_worker* w, const char* program) {
+    int fds[2];
+    if (socketpair(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1) {
+        printf("errno is: %d\n", errno);
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        printf("errno is: %d\n", errno);
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    } else if (pid == 0) {
+        // client sockets, the epoll fd and other channels are CLOEXEC
+        close(listenfd);
+        dup2(fds[1], STDIN_FILENO);
+        setenv("CGI_PERSISTENT", "1", 1);
+        execl(program, program, (char*)0);
+        exit(1);
+    }
+    close(fds[1]);
+    // only our end: the worker reads its requests blocking
+    setnonblocking(fds[0]);
+
+    w->pid = pid;
+    w->fd = fds[0];
+    strncpy(w->program, program, BUFFER_SIZE - 1);
+    w->program[BUFFER_SIZE - 1] = '\0';
+    w->client = -1;
+    w->discarding = false;
+    w->request_id = 0;
+    w->served = 0;
+    w->pending_len = 0;
+    w->pending_off = 0;
+    w->reader.got = 0;
+    // level triggered: we read at most one frame per event
+    epoll_event event;
+    event.data.fd = w->fd;
+    event.events = EPOLLIN;
+    epoll_ctl(child_epollfd, EPOLL_CTL_ADD, w->fd, &event);
+    return true;
+}
+
+// an idle worker already running program, else a fresh one in an empty slot
+// or in place of an idle worker for some other program
+cgi_worker* pick_worker(int child_epollfd, const char* program) {
+    cgi_worker* empty = NULL;
+    cgi_worker* victim = NULL;
+    for (int i = 0; i < CGI_WORKER_COUNT; ++i) {
+        cgi_worker* w = &cgi_workers[i];
+        if (w->fd == -1) {
+            if (!empty) {
+                empty = w;
+            }
+        } else if ((w->client == -1) && !w->discarding) {
+            if (strcmp(w->program, program) == 0) {
+                return w;
+            }
+            if (!victim) {
+                victim = w;
+            }
+        }
+    }
+    if (!empty && victim) {
+        retire_worker(child_epollfd, victim);
+        empty = victim;
+    }
+    if (empty && spawn_worker(child_epollfd, empty, program)) {
+        return empty;
+    }
+    return NULL;
+}
+
+void start_request(int child_epollfd, cgi_worker* w, int client,
+                   const char* line) {
+    w->client = client;
+    w->request_id++;
+    // the channel is idle, a request line always fits its send buffer
+    if (!cgi_write_frame(w->fd, CGI_BEGIN, w->request_id, line,
+                         strlen(line))) {
+        retire_worker(child_epollfd, w);
+    }
+}
+
+void drain_cgi_queue(int child_epollfd) {
+    while (cgi_queue_len > 0) {
+        cgi_request* r = &cgi_queue[cgi_queue_head];
+        cgi_worker* w = pick_worker(child_epollfd, r->program);
+        if (!w) {
+            break;
+        }
+        cgi_queue_head = (cgi_queue_head + 1) % CGI_QUEUE_SIZE;
+        cgi_queue_len--;
+        start_request(child_epollfd, w, r->client, r->program);
+    }
+}
+
+void submit_cgi(int child_epollfd, int client, const char* line) {
+    epoll_ctl(child_epollfd, EPOLL_CTL_DEL, client, 0);
+    if (cgi_queue_len == 0) {
+        cgi_worker* w = pick_worker(child_epollfd, line);
+        if (w) {
+            start_request(child_epollfd, w, client, line);
+            return;
+        }
+    }
+
+    bool busy = false;
+    for (int i = 0; i < CGI_WORKER_COUNT; ++i) {
+        busy = busy || (cgi_workers[i].client != -1) ||
+               cgi_workers[i].discarding;
+    }
+    // nobody will ever drain the queue if no worker is running a request
+    if (!busy || (cgi_queue_len == CGI_QUEUE_SIZE)) {
+        printf("no cgi worker for %s\n", line);
+        close_client(client);
+        return;
+    }
+    cgi_request* r =
+        &cgi_queue[(cgi_queue_head + cgi_queue_len) % CGI_QUEUE_SIZE];
+    r->client = client;
+    strcpy(r->program, line);
+    cgi_queue_len++;
+}
+
+void finish_request(int child_epollfd, cgi_worker* w) {
+    if (w->client != -1) {
+        close_client(w->client);
+        w->client = -1;
+    }
+    w->discarding = false;
+    if (++w->served >= CGI_MAX_REQUESTS) {
+        retire_worker(child_epollfd, w);
+    }
+    drain_cgi_queue(child_epollfd);
+}
+
+// the worker is fine, only its client failed: keep reading the channel
+void drop_client(int child_epollfd, cgi_worker* w) {
+    epoll_ctl(child_epollfd, EPOLL_CTL_DEL, w->client, 0);
+    close_client(w->client);
+    w->client = -1;
+    w->discarding = true;
+    w->pending_len = 0;
+    w->pending_off = 0;
+    epoll_event event;
+    event.data.fd = w->fd;
+    event.events = EPOLLIN;
+    epoll_ctl(child_epollfd, EPOLL_CTL_MOD, w->fd, &event);
+}
+
+// returns false once the client is gone
+bool flush_pending(cgi_worker* w) {
+    while (w->pending_off < w->pending_len) {
+        int ret = send(w->client, w->pending + w->pending_off,
+                       w->pending_len - w->pending_off, MSG_NOSIGNAL);
+        if (ret < 0) {
+            return errno == EAGAIN;
+        }
+        w->pending_off += ret;
+    }
+    w->pending_len = 0;
+    w->pending_off = 0;
+    return true;
+}
+
+void on_worker_readable(int child_epollfd, cgi_worker* w) {
+    int len = cgi_read_frame_some(w->fd, &w->reader, w->pending, CGI_MAX_FRAME);
+    if (len == CGI_FRAME_AGAIN) {
+        return;
+    }
+    if (len < 0) {
+        // crashed or speaks something else, its request dies with it
+        retire_worker(child_epollfd, w);
+        drain_cgi_queue(child_epollfd);
+        return;
+    }
+    const cgi_frame_header& hdr = w->reader.hdr;
+    bool running = (w->client != -1) || w->discarding;
+    if (!running || (hdr.request_id != w->request_id)) {
+        return;
+    }
+    if (hdr.type == CGI_END) {
+        finish_request(child_epollfd, w);
+        return;
+    }
+    if ((hdr.type != CGI_STDOUT) || w->discarding) {
+        return;
+    }
+
+    w->pending_len = len;
+    w->pending_off = 0;
+    if (!flush_pending(w)) {
+        drop_client(child_epollfd, w);
+        return;
+    }
+    if (w->pending_len > 0) {
+        epoll_event event;
+        event.data.fd = w->fd;
+        event.events = 0;
+        epoll_ctl(child_epollfd, EPOLL_CTL_MOD, w->fd, &event);
+        event.data.fd = w->client;
+        event.events = EPOLLOUT;
+        epoll_ctl(child_epollfd, EPOLL_CTL_ADD, w->client, &event);
+    }
+}
+
+void on_client_writable(int child_epollfd, cgi_worker* w) {
+    if (!flush_pending(w)) {
+        drop_client(child_epollfd, w);
+        return;
+    }
+    if (w->pending_len > 0) {
+        return;
+    }
+    epoll_ctl(child_epollfd, EPOLL_CTL_DEL, w->client, 0);
+    epoll_event event;
+    event.data.fd = w->fd;
+    event.events = EPOLLIN;
+    epoll_ctl(child_epollfd, EPOLL_CTL_MOD, w->fd, &event);
+}
+
+cgi_worker* find_worker(int fd, bool by_client) {
+    for (int i = 0; i < CGI_WORKER_COUNT; ++i) {
+        cgi_worker* w = &cgi_workers[i];
+        if ((w->fd != -1) && ((by_client ? w->client : w->fd) == fd)) {
+            return w;
+        }
+    }
+    return NULL;
+}
+
 int run_child(int idx) {
     epoll_event events[MAX_EVENT_NUMBER];
-    int child_epollfd = epoll_create(5);
+    int child_epollfd = epoll_create1(EPOLL_CLOEXEC);
     assert(child_epollfd != -1);
+    for (int i = 0; i < CGI_WORKER_COUNT; ++i) {
+        cgi_workers[i].pid = -1;
+        cgi_workers[i].fd = -1;
+        cgi_workers[i].client = -1;
+        cgi_workers[i].discarding = false;
+    }
     int pipefd = sub_process[idx].pipefd[1];
+    fcntl(pipefd, F_SETFD, FD_CLOEXEC);
     addfd(child_epollfd, pipefd);
     int ret;
     addsig(SIGTERM, child_term_handler, false);
@@ -107,9 +398,12 @@ int run_child(int idx) {
 
         for (int i = 0; i < number; i++) {
             int sockfd = events[i].data.fd;
+            cgi_worker* w = NULL;
             if ((sockfd == pipefd) && (events[i].events & EPOLLIN)) {
-                int client = 0;
-                ret = recv(sockfd, (char*)&client, sizeof(client), 0);
+                // one edge may stand for several notifications, and each
+                // may stand for several queued connections: take them all
+                int clients[64];
+                ret = recv(sockfd, (char*)clients, sizeof(clients), 0);
                 if (ret < 0) {
                     if (errno != EAGAIN) {
                         stop_child = true;
@@ -117,20 +411,32 @@ int run_child(int idx) {
                 } else if (ret == 0) {
                     stop_child = true;
                 } else {
-                    struct sockaddr_in client_address;
-                    socklen_t client_addrlength = sizeof(client_address);
-                    int connfd =
-                        accept(listenfd, (struct sockaddr*)&client_address,
-                               &client_addrlength);
-                    if (connfd < 0) {
-                        printf("errno is: %d\n", errno);
-                        continue;
+                    while (true) {
+                        struct sockaddr_in client_address;
+                        socklen_t client_addrlength = sizeof(client_address);
+                        int connfd = accept4(
+                            listenfd, (struct sockaddr*)&client_address,
+                            &client_addrlength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                        if (connfd < 0) {
+                            if ((errno == ECONNABORTED) || (errno == EINTR)) {
+                                continue;
+                            }
+                            // EAGAIN: a sibling got there first
+                            if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                                printf("errno is: %d\n", errno);
+                            }
+                            break;
+                        }
+                        memset(users[connfd].buf, '\0', BUFFER_SIZE);
+                        users[connfd].address = client_address;
+                        users[connfd].read_idx = 0;
+                        addfd(child_epollfd, connfd);
                     }
-                    memset(users[connfd].buf, '\0', BUFFER_SIZE);
-                    users[connfd].address = client_address;
-                    users[connfd].read_idx = 0;
-                    addfd(child_epollfd, connfd);
                 }
+            } else if ((w = find_worker(sockfd, false)) != NULL) {
+                on_worker_readable(child_epollfd, w);
+            } else if ((w = find_worker(sockfd, true)) != NULL) {
+                on_client_writable(child_epollfd, w);
             } else if (events[i].events & EPOLLIN) {
                 int idx = 0;
                 while (true) {
@@ -162,6 +468,10 @@ int run_child(int idx) {
                             close(sockfd);
                             break;
                         }
+                        if (persistent_cgi) {
+                            submit_cgi(child_epollfd, sockfd, file_name);
+                            break;
+                        }
                         ret = fork();
                         if (ret == -1) {
                             epoll_ctl(child_epollfd, EPOLL_CTL_DEL, sockfd, 0);
@@ -185,6 +495,16 @@ int run_child(int idx) {
         }
     }
 
+    for (int i = 0; i < CGI_WORKER_COUNT; ++i) {
+        if (cgi_workers[i].fd != -1) {
+            retire_worker(child_epollfd, &cgi_workers[i]);
+        }
+    }
+    while (cgi_queue_len > 0) {
+        close_client(cgi_queue[cgi_queue_head].client);
+        cgi_queue_head = (cgi_queue_head + 1) % CGI_QUEUE_SIZE;
+        cgi_queue_len--;
+    }
     delete[] users;
     close(pipefd);
     close(child_epollfd);
@@ -193,11 +513,13 @@ int run_child(int idx) {
 
 int main(int argc, char* argv[]) {
     if (argc <= 2) {
-        printf("usage: %s ip_address port_number\n", basename(argv[0]));
+        printf("usage: %s ip_address port_number [persistent]\n",
+               basename(argv[0]));
         return 1;
     }
     const char* ip = argv[1];
     int port = atoi(argv[2]);
+    persistent_cgi = (argc > 3) && (strcmp(argv[3], "persistent") == 0);
 
     int ret = 0;
     struct sockaddr_in address;
@@ -212,7 +534,8 @@ int main(int argc, char* argv[]) {
     ret = bind(listenfd, (struct sockaddr*)&address, sizeof(address));
     assert(ret != -1);
 
-    ret = listen(listenfd, 5);
+    // the kernel caps this at net.core.somaxconn
+    ret = listen(listenfd, SOMAXCONN);
     assert(ret != -1);
 
     for (int i = 0; i < PROCESS_COUNT; ++i) {
@@ -238,14 +561,12 @@ int main(int argc, char* argv[]) {
     assert(epollfd != -1);
     addfd(epollfd, listenfd);
 
-    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sig_pipefd);
-    assert(ret != -1);
-    setnonblocking(sig_pipefd[1]);
-    addfd(epollfd, sig_pipefd[0]);
-
-    addsig(SIGCHLD, sig_handler);
-    addsig(SIGTERM, sig_handler);
-    addsig(SIGINT, sig_handler);
+    // only the parent reads signals this way; the children forked above
+    // keep their handlers and an unblocked mask for their CGI programs
+    signals.add(SIGCHLD);
+    signals.add(SIGTERM);
+    signals.add(SIGINT);
+    addfd(epollfd, signals.fd());
     addsig(SIGPIPE, SIG_IGN);
     bool stop_server = false;
     int sub_process_counter = 0;
@@ -265,18 +586,11 @@ int main(int argc, char* argv[]) {
                      (char*)&new_conn, sizeof(new_conn), 0);
                 printf("send request to child %d\n", sub_process_counter - 1);
                 sub_process_counter %= PROCESS_COUNT;
-            } else if ((sockfd == sig_pipefd[0]) &&
+            } else if ((sockfd == signals.fd()) &&
                        (events[i].events & EPOLLIN)) {
-                int sig;
-                char signals[1024];
-                ret = recv(sig_pipefd[0], signals, sizeof(signals), 0);
-                if (ret == -1) {
-                    continue;
-                } else if (ret == 0) {
-                    continue;
-                } else {
-                    for (int i = 0; i < ret; ++i) {
-                        switch (signals[i]) {
+                while (signals.read_batch() > 0) {
+                    for (int i = 0; i < signals.count(); ++i) {
+                        switch (signals.info(i).ssi_signo) {
                             case SIGCHLD: {
                                 pid_t pid;
                                 int stat;
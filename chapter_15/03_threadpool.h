@@ -2,32 +2,56 @@
 #define THREADPOOL_H
 
 #include <pthread.h>
+#include <time.h>
 
+#include <atomic>
 #include <cstdio>
 #include <exception>
 #include <list>
 
+#include "async_log.h"
 #include "locker.h"
 
+// Requests that waited too long are shed with T::shed() instead of being
+// processed, CoDel style: while the queue has drained to empty within the
+// last INTERVAL_US, a request may wait up to INTERVAL_US; once it has
+// stayed non-empty for longer than that the queue is standing, and
+// anything that waited over TARGET_US is shed so the rest are served
+// promptly. Priority requests (health checks) go to the front and are
+// never shed or refused.
 template <typename T>
 class threadpool {
+public:
+    static const long TARGET_US = 5000;
+    static const long INTERVAL_US = 100000;
+
 public:
     threadpool(int thread_number = 8, int max_requests = 10000);
     ~threadpool();
-    bool append(T* request);
+    bool append(T* request, bool priority = false);
+    long shed_count() const { return m_shed.load(); }
 
 private:
+    struct work {
+        T* request;
+        long enqueued_us;
+        bool priority;
+    };
+
     static void* worker(void* arg);
+    static long now_us();
     void run();
 
 private:
     int m_thread_number;
     int m_max_requests;
     pthread_t* m_threads;
-    std::list<T*> m_workqueue;
+    std::list<work> m_workqueue;
     locker m_queuelocker;
     sem m_queuestat;
     bool m_stop;
+    long m_last_empty_us;  // guarded by m_queuelocker
+    std::atomic<long> m_shed;
 };
 
 template <typename T>
@@ -35,7 +59,9 @@ threadpool<T>::threadpool(int thread_number, int max_requests)
     : m_thread_number(thread_number),
       m_max_requests(max_requests),
       m_stop(false),
-      m_threads(NULL) {
+      m_threads(NULL),
+      m_last_empty_us(now_us()),
+      m_shed(0) {
     if ((thread_number <= 0) || (max_requests <= 0)) {
         throw std::exception();
     }
@@ -46,7 +72,7 @@ threadpool<T>::threadpool(int thread_number, int max_requests)
     }
 
     for (int i = 0; i < thread_number; ++i) {
-        printf("create the %dth thread\n", i);
+        ALOG_INFO("create the %dth thread", i);
         if (pthread_create(m_threads + i, NULL, worker, this) != 0) {
             delete[] m_threads;
             throw std::exception();
@@ -65,13 +91,31 @@ threadpool<T>::~threadpool() {
 }
 
 template <typename T>
-bool threadpool<T>::append(T* request) {
+long threadpool<T>::now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+template <typename T>
+bool threadpool<T>::append(T* request, bool priority) {
+    work w;
+    w.request = request;
+    w.enqueued_us = now_us();
+    w.priority = priority;
     m_queuelocker.lock();
-    if (m_workqueue.size() > m_max_requests) {
+    // empty up to now, however long the pool sat idle before
+    if (m_workqueue.empty()) {
+        m_last_empty_us = w.enqueued_us;
+    }
+    if (priority) {
+        m_workqueue.push_front(w);
+    } else if (m_workqueue.size() > m_max_requests) {
         m_queuelocker.unlock();
         return false;
+    } else {
+        m_workqueue.push_back(w);
     }
-    m_workqueue.push_back(request);
     m_queuelocker.unlock();
     m_queuestat.post();
     return true;
@@ -93,13 +137,26 @@ void threadpool<T>::run() {
             m_queuelocker.unlock();
             continue;
         }
-        T* request = m_workqueue.front();
+        work w = m_workqueue.front();
         m_workqueue.pop_front();
+        long now = now_us();
+        long limit = INTERVAL_US;
+        if (now - m_last_empty_us > INTERVAL_US) {
+            limit = TARGET_US;
+        }
+        if (m_workqueue.empty()) {
+            m_last_empty_us = now;
+        }
         m_queuelocker.unlock();
-        if (!request) {
+        if (!w.request) {
+            continue;
+        }
+        if (!w.priority && (now - w.enqueued_us > limit)) {
+            m_shed++;
+            w.request->shed();
             continue;
         }
-        request->process();
+        w.request->process();
     }
 }
 
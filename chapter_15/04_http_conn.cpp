@@ -14,6 +14,15 @@ const char* error_500_title = "Internal Error";
 const char* error_500_form =
     "There was an unusual problem serving the requested file.\n";
 const char* doc_root = "/var/www/html";
+// answered by the server itself and admitted even under overload
+const char* health_check_url = "/health";
+const char* health_ok = "ok\n";
+// built once, sent as is when shedding load
+const char overload_503[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Retry-After: 1\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n\r\n";
 
 int setnonblocking(int fd) {
     int old_option = fcntl(fd, F_GETFL);
@@ -22,50 +31,132 @@ int setnonblocking(int fd) {
     return old_option;
 }
 
-void addfd(int epollfd, int fd, bool one_shot) {
-    epoll_event event;
-    event.data.fd = fd;
-    event.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+void addfd(event_loop* loop, int fd, bool one_shot) {
+    int events = EPOLLIN | EPOLLET | EPOLLRDHUP;
     if (one_shot) {
-        event.events |= EPOLLONESHOT;
+        events |= EPOLLONESHOT;
     }
-    epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
+    loop->add(fd, events);
     setnonblocking(fd);
 }
 
-void removefd(int epollfd, int fd) {
-    epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, 0);
+void removefd(event_loop* loop, int fd) {
+    loop->del(fd, true);
     close(fd);
 }
 
-void modfd(int epollfd, int fd, int ev) {
-    epoll_event event;
-    event.data.fd = fd;
-    event.events = ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
-    epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
+void modfd(event_loop* loop, int fd, int ev, bool one_shot = true,
+           bool force = false) {
+    int events = ev | EPOLLET | EPOLLRDHUP;
+    if (one_shot) {
+        events |= EPOLLONESHOT;
+    }
+    loop->mod(fd, events, force);
+}
+
+std::atomic<int> http_conn::m_user_count(0);
+event_loop* http_conn::m_loop = NULL;
+bool http_conn::m_one_shot = false;
+std::atomic<long> http_conn::m_epoll_ctl_saved(0);
+socket_policy http_conn::m_policy;
+conn_table<http_conn>* http_conn::m_table = NULL;
+
+// Without EPOLLONESHOT the fd stays armed, so a second event can arrive while
+// a worker still owns the connection. The loser records it as pending and the
+// owner replays it on release.
+bool http_conn::acquire() {
+    if (m_one_shot) {
+        return true;
+    }
+    while (true) {
+        bool expected = false;
+        if (m_owned.compare_exchange_strong(expected, true)) {
+            m_pending = false;
+            return true;
+        }
+        m_pending = true;
+        if (m_owned) {
+            return false;
+        }
+    }
+}
+
+void http_conn::release() {
+    if (m_one_shot) {
+        return;
+    }
+    m_owned = false;
+    if (m_pending.exchange(false) && (m_sockfd != -1)) {
+        // EPOLL_CTL_MOD re-evaluates readiness and requeues the lost edge
+        modfd(m_loop, m_sockfd, m_events, false, true);
+    }
+}
+
+void http_conn::rearm(int ev) {
+    if (m_sockfd == -1) {
+        return;
+    }
+    if (ev == m_events) {
+        m_epoll_ctl_saved++;
+        return;
+    }
+    modfd(m_loop, m_sockfd, ev, m_one_shot);
+    m_events = ev;
+}
+
+// A fresh or idle connection has room in its send buffer for the short
+// 503; if it does not fit the client sees a reset, as it would on timeout.
+void http_conn::refuse(int sockfd) {
+    send(sockfd, overload_503, sizeof(overload_503) - 1,
+         MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(sockfd);
+}
+
+void http_conn::shed() {
+    if (m_sockfd != -1) {
+        send(m_sockfd, overload_503, sizeof(overload_503) - 1,
+             MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    close_conn();
 }
 
-int http_conn::m_user_count = 0;
-int http_conn::m_epollfd = -1;
+// looks at the raw request line, before parsing, to decide admission
+bool http_conn::is_health_check() const {
+    int len = strlen(health_check_url);
+    if ((m_read_idx < len + 5) || (strncmp(m_read_buf, "GET ", 4) != 0) ||
+        (strncmp(m_read_buf + 4, health_check_url, len) != 0)) {
+        return false;
+    }
+    char next = m_read_buf[4 + len];
+    return (next == ' ') || (next == '?');
+}
 
 void http_conn::close_conn(bool real_close) {
     if (real_close && (m_sockfd != -1)) {
-        // modfd( m_epollfd, m_sockfd, EPOLLIN );
-        removefd(m_epollfd, m_sockfd);
+        int sockfd = m_sockfd;
         m_sockfd = -1;
         m_user_count--;
+        if (!m_table) {
+            removefd(m_loop, sockfd);
+            return;
+        }
+        // the FIN goes out now; the fd is closed by the table's next
+        // collect(), and stale events for it find this object busy
+        m_loop->del(sockfd, true);
+        shutdown(sockfd, SHUT_RDWR);
+        m_table->retire(sockfd, this);
     }
 }
 
+// sockfd comes from accept4(SOCK_NONBLOCK) and is not in the loop yet: the
+// first rearm() registers it, with EPOLLIN if the request is not here yet
+// or straight away with EPOLLOUT once a worker has the response ready
 void http_conn::init(int sockfd, const sockaddr_in& addr) {
     m_sockfd = sockfd;
     m_address = addr;
-    int error = 0;
-    socklen_t len = sizeof(error);
-    getsockopt(m_sockfd, SOL_SOCKET, SO_ERROR, &error, &len);
-    int reuse = 1;
-    setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-    addfd(m_epollfd, sockfd, true);
+    m_events = 0;
+    m_owned = false;
+    m_pending = false;
     m_user_count++;
 
     init();
@@ -84,6 +175,9 @@ void http_conn::init() {
     m_checked_idx = 0;
     m_read_idx = 0;
     m_write_idx = 0;
+    m_bytes_to_send = 0;
+    m_file_address = 0;
+    m_corked = false;
     memset(m_read_buf, '\0', READ_BUFFER_SIZE);
     memset(m_write_buf, '\0', WRITE_BUFFER_SIZE);
     memset(m_real_file, '\0', FILENAME_LEN);
@@ -118,6 +212,9 @@ http_conn::LINE_STATUS http_conn::parse_line() {
 }
 
 bool http_conn::read() {
+    if (m_one_shot) {
+        m_events = 0;
+    }
     if (m_read_idx >= READ_BUFFER_SIZE) {
         return false;
     }
@@ -205,7 +302,7 @@ http_conn::HTTP_CODE http_conn::parse_headers(char* text) {
         text += strspn(text, " \t");
         m_host = text;
     } else {
-        printf("oop! unknow header %s\n", text);
+        ALOG_DEBUG("oop! unknow header %s", text);
     }
 
     return NO_REQUEST;
@@ -230,7 +327,7 @@ http_conn::HTTP_CODE http_conn::process_read() {
         ((line_status = parse_line()) == LINE_OK)) {
         text = get_line();
         m_start_line = m_checked_idx;
-        printf("got 1 http line: %s\n", text);
+        ALOG_DEBUG("got 1 http line: %s", text);
 
         switch (m_check_state) {
             case CHECK_STATE_REQUESTLINE: {
@@ -267,6 +364,11 @@ http_conn::HTTP_CODE http_conn::process_read() {
 }
 
 http_conn::HTTP_CODE http_conn::do_request() {
+    int health_len = strlen(health_check_url);
+    if ((strncmp(m_url, health_check_url, health_len) == 0) &&
+        ((m_url[health_len] == '\0') || (m_url[health_len] == '?'))) {
+        return HEALTH_REQUEST;
+    }
     strcpy(m_real_file, doc_root);
     int len = strlen(doc_root);
     strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);
@@ -294,14 +396,20 @@ void http_conn::unmap() {
         munmap(m_file_address, m_file_stat.st_size);
         m_file_address = 0;
     }
+    if (m_corked) {
+        // pushes out the last partial segment
+        set_cork(m_sockfd, false);
+        m_corked = false;
+    }
 }
 
 bool http_conn::write() {
     int temp = 0;
-    int bytes_have_send = 0;
-    int bytes_to_send = m_write_idx;
-    if (bytes_to_send == 0) {
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
+    if (m_one_shot) {
+        m_events = 0;
+    }
+    if (m_bytes_to_send == 0) {
+        rearm(EPOLLIN);
         init();
         return true;
     }
@@ -310,23 +418,33 @@ bool http_conn::write() {
         temp = writev(m_sockfd, m_iv, m_iv_count);
         if (temp <= -1) {
             if (errno == EAGAIN) {
-                modfd(m_epollfd, m_sockfd, EPOLLOUT);
+                rearm(EPOLLOUT);
                 return true;
             }
             unmap();
             return false;
         }
 
-        bytes_to_send -= temp;
-        bytes_have_send += temp;
-        if (bytes_to_send <= bytes_have_send) {
+        // a short write (TCP_NOTSENT_LOWAT makes them common) resumes
+        // from where it stopped on the next EPOLLOUT
+        m_bytes_to_send -= temp;
+        for (int i = 0; (i < m_iv_count) && (temp > 0); ++i) {
+            size_t n = m_iv[i].iov_len;
+            if ((size_t)temp < n) {
+                n = temp;
+            }
+            m_iv[i].iov_base = (char*)m_iv[i].iov_base + n;
+            m_iv[i].iov_len -= n;
+            temp -= n;
+        }
+        if (m_bytes_to_send <= 0) {
             unmap();
             if (m_linger) {
                 init();
-                modfd(m_epollfd, m_sockfd, EPOLLIN);
+                rearm(EPOLLIN);
                 return true;
             } else {
-                modfd(m_epollfd, m_sockfd, EPOLLIN);
+                rearm(EPOLLIN);
                 return false;
             }
         }
@@ -354,15 +472,20 @@ bool http_conn::add_status_line(int status, const char* title) {
 }
 
 bool http_conn::add_headers(int content_len) {
+    add_date();
     add_content_length(content_len);
     add_linger();
-    add_blank_line();
+    return add_blank_line();
 }
 
 bool http_conn::add_content_length(int content_len) {
     return add_response("Content-Length: %d\r\n", content_len);
 }
 
+bool http_conn::add_date() {
+    return add_response("Date: %s\r\n", cached_http_date());
+}
+
 bool http_conn::add_linger() {
     return add_response("Connection: %s\r\n",
                         (m_linger == true) ? "keep-alive" : "close");
@@ -408,6 +531,14 @@ bool http_conn::process_write(HTTP_CODE ret) {
             }
             break;
         }
+        case HEALTH_REQUEST: {
+            add_status_line(200, ok_200_title);
+            add_headers(strlen(health_ok));
+            if (!add_content(health_ok)) {
+                return false;
+            }
+            break;
+        }
         case FILE_REQUEST: {
             add_status_line(200, ok_200_title);
             if (m_file_stat.st_size != 0) {
@@ -417,6 +548,12 @@ bool http_conn::process_write(HTTP_CODE ret) {
                 m_iv[1].iov_base = m_file_address;
                 m_iv[1].iov_len = m_file_stat.st_size;
                 m_iv_count = 2;
+                m_bytes_to_send = m_write_idx + m_file_stat.st_size;
+                size_send_buffer(m_sockfd, m_policy, m_file_stat.st_size);
+                if (m_policy.cork_files) {
+                    set_cork(m_sockfd, true);
+                    m_corked = true;
+                }
                 return true;
             } else {
                 const char* ok_string = "<html><body></body></html>";
@@ -434,20 +571,24 @@ bool http_conn::process_write(HTTP_CODE ret) {
     m_iv[0].iov_base = m_write_buf;
     m_iv[0].iov_len = m_write_idx;
     m_iv_count = 1;
+    m_bytes_to_send = m_write_idx;
     return true;
 }
 
 void http_conn::process() {
     HTTP_CODE read_ret = process_read();
     if (read_ret == NO_REQUEST) {
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
+        rearm(EPOLLIN);
+        release();
         return;
     }
 
     bool write_ret = process_write(read_ret);
     if (!write_ret) {
         close_conn();
+        return;
     }
 
-    modfd(m_epollfd, m_sockfd, EPOLLOUT);
+    rearm(EPOLLOUT);
+    release();
 }
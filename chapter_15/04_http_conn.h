@@ -17,9 +17,16 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <atomic>
+
+#include "async_log.h"
+#include "conn_table.h"
+#include "event_loop.h"
 #include "locker.h"
+#include "socket_policy.h"
 
 class http_conn {
 public:
@@ -52,6 +59,7 @@ public:
         NO_RESOURCE,
         FORBIDDEN_REQUEST,
         FILE_REQUEST,
+        HEALTH_REQUEST,
         INTERNAL_ERROR,
         CLOSED_CONNECTION
     };
@@ -69,6 +77,17 @@ public:
     void process();
     bool read();
     bool write();
+    bool acquire();
+    void release();
+    bool has_input() const { return m_read_idx > 0; }
+    bool is_health_check() const;
+    // answers 503 with Retry-After and closes, for a request the server
+    // will not get to in time
+    void shed();
+    // the same for a socket that never got an http_conn
+    static void refuse(int sockfd);
+    // registers for EPOLLIN, for a connection accepted without data yet
+    void watch_input() { rearm(EPOLLIN); }
 
 private:
     void init();
@@ -84,22 +103,33 @@ private:
 
     LINE_STATUS parse_line();
 
+    void rearm(int ev);
     void unmap();
     bool add_response(const char* format, ...);
     bool add_content(const char* content);
     bool add_status_line(int status, const char* title);
     bool add_headers(int content_length);
     bool add_content_length(int content_length);
+    bool add_date();
     bool add_linger();
     bool add_blank_line();
 
 public:
-    static int m_epollfd;
-    static int m_user_count;
+    static event_loop* m_loop;
+    static std::atomic<int> m_user_count;
+    static bool m_one_shot;
+    static std::atomic<long> m_epoll_ctl_saved;
+    // applied to the listener by main, read here for file responses
+    static socket_policy m_policy;
+    // where a closed connection goes back to, NULL when not table-managed
+    static conn_table<http_conn>* m_table;
 
 private:
     int m_sockfd;
     sockaddr_in m_address;
+    int m_events;
+    std::atomic<bool> m_owned;
+    std::atomic<bool> m_pending;
 
     char m_read_buf[READ_BUFFER_SIZE];
     int m_read_idx;
@@ -122,6 +152,8 @@ private:
     struct stat m_file_stat;
     struct iovec m_iv[2];
     int m_iv_count;
+    long m_bytes_to_send;
+    bool m_corked;
 };
 
 #endif
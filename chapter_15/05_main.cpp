@@ -1,25 +1,39 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <cassert>
 
+#include "conn_table.h"
+#include "event_loop.h"
 #include "http_conn.h"
 #include "locker.h"
+#include "signal_source.h"
 #include "threadpool.h"
 
 #define MAX_FD 65536
 #define MAX_EVENT_NUMBER 10000
+// fds below RLIMIT_NOFILE kept back for health checks; other connections
+// past that are shed
+#define HEALTH_RESERVE 64
+// -d with a log file: rotated at this size or age, 5 old files kept
+#define LOG_FILE_MAX_BYTES (64L * 1024 * 1024)
+#define LOG_FILE_MAX_AGE (24 * 3600)
+// where a daemon logs when there is no syslog socket
+#define FALLBACK_LOG_FILE "/tmp/httpd.log"
 
-extern int addfd(int epollfd, int fd, bool one_shot);
-extern int removefd(int epollfd, int fd);
+extern void addfd(event_loop* loop, int fd, bool one_shot);
+extern void removefd(event_loop* loop, int fd);
 
 void addsig(int sig, void(handler)(int), bool restart = true) {
     struct sigaction sa;
@@ -32,20 +46,181 @@ void addsig(int sig, void(handler)(int), bool restart = true) {
     assert(sigaction(sig, &sa, NULL) != -1);
 }
 
-void show_error(int connfd, const char* info) {
-    printf("%s", info);
-    send(connfd, info, strlen(info), 0);
-    close(connfd);
+// as chapter_07/03_daemonize.c; before any thread exists, they do not
+// survive the fork
+bool daemonize() {
+    pid_t pid = fork();
+    if (pid < 0) {
+        return false;
+    } else if (pid > 0) {
+        exit(0);
+    }
+    umask(0);
+    if (setsid() < 0) {
+        return false;
+    }
+    if (chdir("/") < 0) {
+        return false;
+    }
+    // stdout is /dev/null from here on, the log goes to syslog or a file
+    close(STDIN_FILENO);
+    close(STDOUT_FILENO);
+    close(STDERR_FILENO);
+    open("/dev/null", O_RDONLY);
+    open("/dev/null", O_RDWR);
+    open("/dev/null", O_RDWR);
+    return true;
+}
+
+// daemonize() moves to /, so a relative log file is made absolute first
+static bool absolute_path(const char* path, char* out, size_t size) {
+    if (path[0] == '/') {
+        return (size_t)snprintf(out, size, "%s", path) < size;
+    }
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        return false;
+    }
+    return (size_t)snprintf(out, size, "%s/%s", cwd, path) < size;
+}
+
+// kept open so a connection can still be accepted and refused at EMFILE,
+// instead of leaving it in the queue with the edge already consumed
+static int spare_fd = -1;
+static int backlog = 0;
+// set from RLIMIT_NOFILE at startup, MAX_FD - HEALTH_RESERVE at most
+static int shed_above = MAX_FD - HEALTH_RESERVE;
+static long accepted = 0;
+static long turned_away = 0;
+static int largest_burst = 0;
+static listen_stats last_listen_stats;
+static int peak_conns = 0;
+static long peak_bytes = 0;
+static int next_report = 1;
+
+// The listener is edge triggered: take everything queued, until EAGAIN.
+void accept_conns(int listenfd, conn_table<http_conn>* conns,
+                  threadpool<http_conn>* pool) {
+    int burst = 0;
+    while (true) {
+        struct sockaddr_in client_address;
+        socklen_t client_addrlength = sizeof(client_address);
+        int connfd = accept4(listenfd, (struct sockaddr*)&client_address,
+                             &client_addrlength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                break;
+            } else if ((errno == EINTR) || (errno == ECONNABORTED)) {
+                continue;
+            } else if (((errno == EMFILE) || (errno == ENFILE)) &&
+                       (spare_fd != -1)) {
+                // EMFILE comes before EAGAIN, so only the spare accept
+                // tells whether the queue is empty yet
+                close(spare_fd);
+                connfd = accept(listenfd, NULL, NULL);
+                if (connfd >= 0) {
+                    close(connfd);
+                    turned_away++;
+                }
+                spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                if (connfd < 0) {
+                    break;
+                }
+                continue;
+            }
+            // EMFILE without a spare fd, ENOBUFS...: once per edge,
+            // possibly for a long while
+            ALOG_LIMITED(LOG_LEVEL_ERROR, 10, "accept errno is: %d", errno);
+            break;
+        }
+        burst++;
+        if ((connfd >= MAX_FD) || (http_conn::m_user_count >= MAX_FD)) {
+            http_conn::refuse(connfd);
+            turned_away++;
+            continue;
+        }
+        http_conn* conn = conns->open(connfd);
+        conn->init(connfd, client_address);
+        // with TCP_DEFER_ACCEPT the request is usually here already: read it
+        // now rather than after another trip through epoll_wait
+        conn->acquire();
+        if (!conn->read()) {
+            conn->close_conn();
+        } else if ((http_conn::m_user_count > shed_above) &&
+                   !conn->is_health_check()) {
+            conn->shed();
+            turned_away++;
+        } else if (!conn->has_input()) {
+            conn->watch_input();
+            conn->release();
+        } else if (!pool->append(conn, conn->is_health_check())) {
+            conn->shed();
+            turned_away++;
+        }
+    }
+    accepted += burst;
+
+    if (burst > largest_burst) {
+        largest_burst = burst;
+    }
+    // a burst that came close to the backlog may have overflowed it
+    listen_stats now;
+    if ((burst * 2 >= backlog) && read_listen_stats(&now) &&
+        (now.overflows > last_listen_stats.overflows)) {
+        ALOG_WARN("accept queue (backlog %d) overflowed %ld times", backlog,
+                  now.overflows - last_listen_stats.overflows);
+        last_listen_stats = now;
+    }
 }
 
 int main(int argc, char* argv[]) {
-    if (argc <= 2) {
-        printf("usage: %s ip_address port_number\n", basename(argv[0]));
+    if ((argc <= 2) || ((argc > 3) && (strcmp(argv[3], "-d") != 0))) {
+        printf("usage: %s ip_address port_number [-d [log_file]]\n",
+               basename(argv[0]));
         return 1;
     }
     const char* ip = argv[1];
     int port = atoi(argv[2]);
 
+    // blocked before the log flusher and the pool threads start, so they
+    // inherit the mask and the loop below is the only place these land
+    signal_source signals;
+    signals.add(SIGTERM);
+    signals.add(SIGINT);
+
+    if (argc > 3) {
+        char log_file[PATH_MAX];
+        if ((argc > 4) && !absolute_path(argv[4], log_file, sizeof(log_file))) {
+            printf("bad log file %s\n", argv[4]);
+            return 1;
+        }
+        if (!daemonize()) {
+            return 1;
+        }
+        bool logging = false;
+        if (argc > 4) {
+            logging =
+                async_log::open(log_file, LOG_FILE_MAX_BYTES, LOG_FILE_MAX_AGE);
+        } else {
+            logging = async_log::open_syslog("httpd");
+        }
+        // a daemon that cannot log anywhere is not worth running
+        if (!logging && !async_log::open(FALLBACK_LOG_FILE, LOG_FILE_MAX_BYTES,
+                                         LOG_FILE_MAX_AGE)) {
+            return 1;
+        }
+        if (!logging) {
+            ALOG_WARN("logging to %s instead", FALLBACK_LOG_FILE);
+        }
+    }
+
+    struct rlimit nofile;
+    if ((getrlimit(RLIMIT_NOFILE, &nofile) == 0) &&
+        (nofile.rlim_cur != RLIM_INFINITY) &&
+        (nofile.rlim_cur < (rlim_t)MAX_FD)) {
+        shed_above = (int)nofile.rlim_cur - HEALTH_RESERVE;
+    }
+
     addsig(SIGPIPE, SIG_IGN);
 
     threadpool<http_conn>* pool = NULL;
@@ -55,14 +230,11 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    http_conn* users = new http_conn[MAX_FD];
-    assert(users);
-    int user_count = 0;
+    conn_table<http_conn> conns(MAX_FD);
+    http_conn::m_table = &conns;
 
     int listenfd = socket(PF_INET, SOCK_STREAM, 0);
     assert(listenfd >= 0);
-    struct linger tmp = {1, 0};
-    setsockopt(listenfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof(tmp));
 
     int ret = 0;
     struct sockaddr_in address;
@@ -74,59 +246,93 @@ int main(int argc, char* argv[]) {
     ret = bind(listenfd, (struct sockaddr*)&address, sizeof(address));
     assert(ret >= 0);
 
-    ret = listen(listenfd, 5);
+    apply_listen_policy(listenfd, http_conn::m_policy);
+    backlog = listen_backlog(http_conn::m_policy);
+    ret = listen(listenfd, backlog);
     assert(ret >= 0);
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    read_listen_stats(&last_listen_stats);
 
-    epoll_event events[MAX_EVENT_NUMBER];
-    int epollfd = epoll_create(5);
-    assert(epollfd != -1);
-    addfd(epollfd, listenfd, false);
-    http_conn::m_epollfd = epollfd;
+    event_loop loop(MAX_EVENT_NUMBER);
+    addfd(&loop, listenfd, false);
+    loop.set_priority(listenfd, event_loop::PRI_ACCEPT);
+    http_conn::m_loop = &loop;
+    addfd(&loop, signals.fd(), false);
 
-    while (true) {
-        int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
+    bool stop_server = false;
+    while (!stop_server) {
+        int number = loop.wait(-1);
+        epoll_event* events = loop.ready();
         if ((number < 0) && (errno != EINTR)) {
-            printf("epoll failure\n");
+            ALOG_ERROR("epoll failure, errno is: %d", errno);
             break;
         }
 
         for (int i = 0; i < number; i++) {
             int sockfd = events[i].data.fd;
             if (sockfd == listenfd) {
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof(client_address);
-                int connfd = accept(listenfd, (struct sockaddr*)&client_address,
-                                    &client_addrlength);
-                if (connfd < 0) {
-                    printf("errno is: %d\n", errno);
-                    continue;
-                }
-                if (http_conn::m_user_count >= MAX_FD) {
-                    show_error(connfd, "Internal server busy");
-                    continue;
+                accept_conns(listenfd, &conns, pool);
+                continue;
+            }
+            if (sockfd == signals.fd()) {
+                // SIGTERM or SIGINT: stop and print the counters below
+                while (signals.read_batch() > 0) {
+                    stop_server = true;
                 }
-
-                users[connfd].init(connfd, client_address);
+                continue;
+            }
+            http_conn* conn = conns.get(sockfd);
+            if (!conn || !conn->acquire()) {
+                continue;
             } else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
-                users[sockfd].close_conn();
+                conn->close_conn();
             } else if (events[i].events & EPOLLIN) {
-                if (users[sockfd].read()) {
-                    pool->append(users + sockfd);
-                } else {
-                    users[sockfd].close_conn();
+                if (!conn->read()) {
+                    conn->close_conn();
+                } else if (!pool->append(conn, conn->is_health_check())) {
+                    conn->shed();
                 }
             } else if (events[i].events & EPOLLOUT) {
-                if (!users[sockfd].write()) {
-                    users[sockfd].close_conn();
+                if (!conn->write()) {
+                    conn->close_conn();
+                } else {
+                    conn->release();
                 }
             } else {
+                conn->release();
+            }
+        }
+        // closes the fds retired so far; only now can accept() reuse their
+        // numbers, with no event for the old connections left in the batch
+        conns.collect();
+        if (conns.live() > peak_conns) {
+            peak_conns = conns.live();
+            peak_bytes = conns.bytes();
+            // each time the peak doubles, so a growing server logs rarely
+            if (peak_conns >= next_report) {
+                ALOG_INFO("%d conns in %ld bytes, %ld bytes per conn",
+                          peak_conns, peak_bytes, conns.bytes_per_conn());
+                while (next_report <= peak_conns) {
+                    next_report *= 2;
+                }
             }
         }
     }
 
-    close(epollfd);
+    ALOG_INFO("epoll_ctl calls saved: %ld",
+              http_conn::m_epoll_ctl_saved.load() + loop.ctl_saved());
+    int queued, limit;
+    accept_queue(listenfd, &queued, &limit);
+    ALOG_INFO("accepted %ld, turned away %ld, shed %ld, largest burst %d, %d "
+              "of %d still queued",
+              accepted, turned_away, pool->shed_count(), largest_burst, queued,
+              limit);
+    ALOG_INFO("%d conns in %ld bytes now, peak %d conns in %ld bytes, %ld "
+              "bytes per conn",
+              conns.live(), conns.bytes(), peak_conns, peak_bytes,
+              peak_conns ? peak_bytes / peak_conns : 0);
+    ALOG_INFO("%ld log lines dropped", async_log::dropped());
     close(listenfd);
-    delete[] users;
     delete pool;
     return 0;
 }
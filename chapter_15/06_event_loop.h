@@ -0,0 +1,307 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <exception>
+#include <vector>
+
+#include "async_log.h"
+#include "locker.h"
+#include "time_cache.h"
+
+// epoll wrapper with a libevent-style changelist: add/mod/del issued on the
+// loop thread are coalesced per fd and applied just before the next
+// epoll_wait. Calls from other threads are applied immediately, merged with
+// whatever is still pending for that fd.
+//
+// Ready events are sorted into per-priority active queues like libevent's
+// activequeues[ev_pri]. wait() hands them out lowest priority number first,
+// at most m_batch[pri] per level, and keeps the rest for the next round.
+//
+// EPOLLPRI (TCP urgent data) is split off into its own queue and handed
+// out ahead of every level, whatever the fd's priority, so a control byte
+// is seen before the bulk data queued behind it on any connection.
+//
+// The clock is read once per round, right after epoll_wait; use
+// cached_time() and cached_http_date() from time_cache.h in callbacks.
+class event_loop {
+public:
+    enum PRIORITY { PRI_CONTROL = 0, PRI_ACCEPT, PRI_IO, N_PRIORITIES };
+
+    static const int DEFAULT_BATCH = 256;
+
+public:
+    event_loop(int max_events = 10000)
+        : m_max_events(max_events), m_requested(0), m_ctl_calls(0) {
+        m_epollfd = epoll_create(5);
+        if (m_epollfd == -1) {
+            throw std::exception();
+        }
+        m_events = new epoll_event[max_events];
+        m_owner = pthread_self();
+        for (int i = 0; i < N_PRIORITIES; ++i) {
+            m_batch[i] = DEFAULT_BATCH;
+            m_active_head[i] = 0;
+        }
+    }
+
+    ~event_loop() {
+        delete[] m_events;
+        close(m_epollfd);
+    }
+
+public:
+    void set_priority(int fd, int pri) {
+        if ((fd < 0) || (pri < 0) || (pri >= N_PRIORITIES)) {
+            return;
+        }
+        m_lock.lock();
+        grow(fd);
+        m_priority[fd] = pri;
+        m_lock.unlock();
+    }
+
+    void set_batch(int pri, int max_per_round) {
+        if ((pri >= 0) && (pri < N_PRIORITIES) && (max_per_round > 0)) {
+            m_batch[pri] = max_per_round;
+        }
+    }
+
+    void add(int fd, int ev) { change(fd, ev, false, false); }
+
+    // force asks for a real EPOLL_CTL_MOD even when the mask is unchanged,
+    // which makes the kernel re-evaluate readiness of an edge-triggered fd
+    void mod(int fd, int ev, bool force = false) {
+        change(fd, ev, force, false);
+    }
+
+    // closing means the caller closes fd right away, which drops the
+    // registration in the kernel, so no EPOLL_CTL_DEL is needed
+    void del(int fd, bool closing = false) { change(fd, 0, false, closing); }
+
+    // returns the number of events in ready(), in priority order
+    int wait(int timeout) {
+        flush();
+        if (has_active()) {
+            timeout = 0;
+        }
+        clear_time_cache();
+        int number = epoll_wait(m_epollfd, m_events, m_max_events, timeout);
+        update_time_cache();
+        if ((number < 0) && !has_active()) {
+            return number;
+        }
+
+        m_lock.lock();
+        for (int i = 0; i < number; i++) {
+            activate(m_events[i]);
+        }
+        m_ready.clear();
+        for (size_t i = 0; i < m_urgent.size(); ++i) {
+            int fd = m_urgent[i];
+            if (m_urgent_pending[fd]) {
+                m_urgent_pending[fd] = false;
+                epoll_event ev;
+                ev.data.fd = fd;
+                ev.events = EPOLLPRI;
+                m_ready.push_back(ev);
+            }
+        }
+        m_urgent.clear();
+        for (int pri = 0; pri < N_PRIORITIES; ++pri) {
+            std::vector<epoll_event>& q = m_active[pri];
+            size_t& head = m_active_head[pri];
+            int taken = 0;
+            while ((head < q.size()) && (taken < m_batch[pri])) {
+                epoll_event& ev = q[head++];
+                if (ev.events == 0) {
+                    continue;
+                }
+                m_active_pos[ev.data.fd] = -1;
+                m_ready.push_back(ev);
+                taken++;
+            }
+            if (head == q.size()) {
+                q.clear();
+                head = 0;
+            } else if (head > q.size() / 2) {
+                q.erase(q.begin(), q.begin() + head);
+                head = 0;
+                for (size_t j = 0; j < q.size(); ++j) {
+                    if (q[j].events != 0) {
+                        m_active_pos[q[j].data.fd] = j;
+                    }
+                }
+            }
+        }
+        m_lock.unlock();
+        return m_ready.size();
+    }
+
+    void flush() {
+        m_lock.lock();
+        for (size_t i = 0; i < m_changes.size(); ++i) {
+            apply(m_changes[i]);
+            m_change_idx[m_changes[i].fd] = -1;
+        }
+        m_changes.clear();
+        m_lock.unlock();
+    }
+
+    epoll_event* ready() { return m_ready.empty() ? NULL : &m_ready[0]; }
+    int epollfd() const { return m_epollfd; }
+    long ctl_calls() const { return m_ctl_calls; }
+    long ctl_saved() const { return m_requested - m_ctl_calls; }
+
+private:
+    struct fd_change {
+        int fd;
+        int old_events;
+        int new_events;
+        bool force;
+    };
+
+    void change(int fd, int ev, bool force, bool closing) {
+        if (fd < 0) {
+            return;
+        }
+        m_lock.lock();
+        m_requested++;
+        grow(fd);
+        if (ev == 0) {
+            // drop anything still queued for the old owner of this fd
+            int pos = m_active_pos[fd];
+            if (pos != -1) {
+                m_active[m_priority[fd]][pos].events = 0;
+                m_active_pos[fd] = -1;
+            }
+            m_priority[fd] = N_PRIORITIES - 1;
+            m_urgent_pending[fd] = false;
+        }
+
+        int idx = m_change_idx[fd];
+        if (idx == -1) {
+            fd_change c;
+            c.fd = fd;
+            c.old_events = m_registered[fd];
+            c.force = false;
+            idx = m_changes.size();
+            m_changes.push_back(c);
+            m_change_idx[fd] = idx;
+        }
+        fd_change& c = m_changes[idx];
+        c.new_events = ev;
+        // a oneshot fd is disarmed after firing, an equal mask proves nothing
+        c.force = c.force || force || (ev & EPOLLONESHOT);
+        if (closing) {
+            c.old_events = 0;
+        }
+
+        if (!pthread_equal(pthread_self(), m_owner)) {
+            apply(c);
+            m_change_idx[fd] = -1;
+            if (idx != (int)m_changes.size() - 1) {
+                m_changes[idx] = m_changes.back();
+                m_change_idx[m_changes[idx].fd] = idx;
+            }
+            m_changes.pop_back();
+        }
+        m_lock.unlock();
+    }
+
+    void grow(int fd) {
+        if (fd >= (int)m_change_idx.size()) {
+            m_change_idx.resize(fd + 1, -1);
+            m_registered.resize(fd + 1, 0);
+            m_priority.resize(fd + 1, N_PRIORITIES - 1);
+            m_active_pos.resize(fd + 1, -1);
+            m_urgent_pending.resize(fd + 1, false);
+        }
+    }
+
+    bool has_active() const {
+        if (!m_urgent.empty()) {
+            return true;
+        }
+        for (int pri = 0; pri < N_PRIORITIES; ++pri) {
+            if (m_active_head[pri] < m_active[pri].size()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // an fd reported again while still queued gets its masks merged
+    void activate(epoll_event ev) {
+        int fd = ev.data.fd;
+        grow(fd);
+        if (ev.events & EPOLLPRI) {
+            ev.events &= ~EPOLLPRI;
+            if (!m_urgent_pending[fd]) {
+                m_urgent_pending[fd] = true;
+                m_urgent.push_back(fd);
+            }
+            if (ev.events == 0) {
+                return;
+            }
+        }
+        int pri = m_priority[fd];
+        if (m_active_pos[fd] != -1) {
+            m_active[pri][m_active_pos[fd]].events |= ev.events;
+            return;
+        }
+        m_active_pos[fd] = m_active[pri].size();
+        m_active[pri].push_back(ev);
+    }
+
+    void apply(const fd_change& c) {
+        int op = -1;
+        if (!c.old_events && c.new_events) {
+            op = EPOLL_CTL_ADD;
+        } else if (c.old_events && !c.new_events) {
+            op = EPOLL_CTL_DEL;
+        } else if (c.old_events &&
+                   ((c.old_events != c.new_events) || c.force)) {
+            op = EPOLL_CTL_MOD;
+        }
+        m_registered[c.fd] = c.new_events;
+        if (op == -1) {
+            return;
+        }
+
+        epoll_event event;
+        event.data.fd = c.fd;
+        event.events = c.new_events;
+        m_ctl_calls++;
+        if (epoll_ctl(m_epollfd, op, c.fd, &event) == -1) {
+            ALOG_ERROR("epoll_ctl(%d) on fd %d failed, errno is: %d", op,
+                       c.fd, errno);
+        }
+    }
+
+private:
+    int m_epollfd;
+    int m_max_events;
+    epoll_event* m_events;
+    pthread_t m_owner;
+    locker m_lock;
+    std::vector<fd_change> m_changes;
+    std::vector<int> m_change_idx;
+    std::vector<int> m_registered;
+    std::vector<int> m_priority;
+    std::vector<int> m_active_pos;
+    std::vector<int> m_urgent;
+    std::vector<bool> m_urgent_pending;
+    std::vector<epoll_event> m_active[N_PRIORITIES];
+    size_t m_active_head[N_PRIORITIES];
+    int m_batch[N_PRIORITIES];
+    std::vector<epoll_event> m_ready;
+    long m_requested;
+    long m_ctl_calls;
+};
+
+#endif
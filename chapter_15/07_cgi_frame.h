@@ -0,0 +1,173 @@
+#ifndef CGI_FRAME_H
+#define CGI_FRAME_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// FastCGI-style framing between 02_pool_cgi and its persistent CGI workers.
+// A worker is exec'd once with CGI_PERSISTENT=1 and the channel on stdin; it
+// then serves request after request:
+//
+//   pool   -> worker   CGI_BEGIN  payload: the request line
+//   worker -> pool     CGI_STDOUT payload: response bytes, any number
+//   worker -> pool     CGI_END    payload: none
+//
+// The pool closes the channel to retire a worker, cgi_accept() then fails.
+// Plain C, so that workers need not be C++.
+
+enum CGI_FRAME_TYPE { CGI_BEGIN = 1, CGI_STDOUT, CGI_END };
+
+typedef struct cgi_frame_header {
+    unsigned char version;
+    unsigned char type;
+    unsigned short request_id;
+    unsigned int length;
+} cgi_frame_header;
+
+#define CGI_FRAME_VERSION 1
+#define CGI_MAX_FRAME 65536u
+
+static inline bool cgi_read_full(int fd, void* buf, size_t len) {
+    char* p = (char*)buf;
+    while (len > 0) {
+        ssize_t ret = read(fd, p, len);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        p += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+static inline bool cgi_write_frame(int fd, int type, int request_id,
+                            const void* data, unsigned int len) {
+    cgi_frame_header hdr;
+    hdr.version = CGI_FRAME_VERSION;
+    hdr.type = type;
+    hdr.request_id = request_id;
+    hdr.length = len;
+
+    struct iovec iv[2];
+    iv[0].iov_base = &hdr;
+    iv[0].iov_len = sizeof(hdr);
+    iv[1].iov_base = (void*)data;
+    iv[1].iov_len = len;
+    struct iovec* cur = iv;
+    int iv_count = len ? 2 : 1;
+    while (iv_count > 0) {
+        ssize_t ret = writev(fd, cur, iv_count);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            return false;
+        }
+        while (iv_count > 0 && (size_t)ret >= cur->iov_len) {
+            ret -= cur->iov_len;
+            cur++;
+            iv_count--;
+        }
+        if (iv_count > 0) {
+            cur->iov_base = (char*)cur->iov_base + ret;
+            cur->iov_len -= ret;
+        }
+    }
+    return true;
+}
+
+// returns the payload length, -1 on EOF, error or an oversized frame
+static inline int cgi_read_frame(int fd, cgi_frame_header* hdr, char* buf,
+                          unsigned int cap) {
+    if (!cgi_read_full(fd, hdr, sizeof(*hdr))) {
+        return -1;
+    }
+    if ((hdr->version != CGI_FRAME_VERSION) || (hdr->length > cap)) {
+        return -1;
+    }
+    if (hdr->length && !cgi_read_full(fd, buf, hdr->length)) {
+        return -1;
+    }
+    return hdr->length;
+}
+
+// A frame read as the bytes come in, for a nonblocking fd: got counts the
+// header and payload bytes so far.
+typedef struct cgi_frame_reader {
+    cgi_frame_header hdr;
+    unsigned int got;
+} cgi_frame_reader;
+
+#define CGI_FRAME_AGAIN (-2)
+
+// as cgi_read_frame(), or CGI_FRAME_AGAIN when the fd runs dry mid-frame;
+// call again with the same reader and buf once it is readable
+static inline int cgi_read_frame_some(int fd, cgi_frame_reader* r, char* buf,
+                                      unsigned int cap) {
+    const unsigned int hdr_len = sizeof(r->hdr);
+    while (true) {
+        char* dst;
+        size_t want;
+        if (r->got < hdr_len) {
+            dst = (char*)&r->hdr + r->got;
+            want = hdr_len - r->got;
+        } else if (r->got - hdr_len < r->hdr.length) {
+            dst = buf + (r->got - hdr_len);
+            want = r->hdr.length - (r->got - hdr_len);
+        } else {
+            r->got = 0;
+            return r->hdr.length;
+        }
+        ssize_t ret = read(fd, dst, want);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return CGI_FRAME_AGAIN;
+        }
+        if (ret <= 0) {
+            return -1;
+        }
+        r->got += ret;
+        if ((r->got == hdr_len) && ((r->hdr.version != CGI_FRAME_VERSION) ||
+                                    (r->hdr.length > cap))) {
+            return -1;
+        }
+    }
+}
+
+// Worker side, the FCGI_Accept() of this protocol: blocks for the next
+// request, copies its request line into query and returns its id.
+static inline int cgi_accept(char* query, unsigned int cap) {
+    cgi_frame_header hdr;
+    while (true) {
+        int len = cgi_read_frame(STDIN_FILENO, &hdr, query, cap - 1);
+        if (len < 0) {
+            return -1;
+        }
+        if (hdr.type == CGI_BEGIN) {
+            query[len] = '\0';
+            return hdr.request_id;
+        }
+    }
+}
+
+static inline bool cgi_write(int request_id, const char* data,
+                             unsigned int len) {
+    return cgi_write_frame(STDIN_FILENO, CGI_STDOUT, request_id, data, len);
+}
+
+static inline bool cgi_finish(int request_id) {
+    return cgi_write_frame(STDIN_FILENO, CGI_END, request_id, NULL, 0);
+}
+
+static inline bool cgi_persistent(void) { return getenv("CGI_PERSISTENT") != NULL; }
+
+#endif
@@ -0,0 +1,29 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cgi_frame.h"
+
+// A CGI program for 02_pool_cgi that works both ways: exec'd per request
+// with stdout on the client socket, or started once as a persistent worker
+// (02_pool_cgi ip port persistent) that answers requests until retired.
+int main() {
+    if (!cgi_persistent()) {
+        printf("hello from pid %d\n", getpid());
+        return 0;
+    }
+
+    char query[1024];
+    char reply[1024 + 64];
+    int served = 0;
+    int id;
+    while ((id = cgi_accept(query, sizeof(query))) >= 0) {
+        int len = snprintf(reply, sizeof(reply),
+                           "hello from pid %d, request %d: %s\n", getpid(),
+                           ++served, query);
+        if (!cgi_write(id, reply, len) || !cgi_finish(id)) {
+            break;
+        }
+    }
+    return 0;
+}
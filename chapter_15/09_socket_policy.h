@@ -0,0 +1,271 @@
+#ifndef SOCKET_POLICY_H
+#define SOCKET_POLICY_H
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <atomic>
+
+// Socket options for the listener and every accepted connection, in one
+// place instead of fixed setsockopt calls as in chapter_05/11_*.
+//
+// Buffers are left to kernel autotuning by default: a fixed SO_SNDBUF or
+// SO_RCVBUF locks that buffer at its size for the life of the socket. The
+// send buffer is only pinned when TCP_INFO says the path needs more than
+// autotuning can grant, see size_send_buffer().
+struct socket_policy {
+    // listen() backlog, 0 for net.core.somaxconn; the kernel silently cuts
+    // anything larger down to somaxconn
+    int backlog;
+    // TCP_DEFER_ACCEPT: a connection is queued for accept() only once its
+    // first bytes arrive, or after this many seconds anyway; 0 turns it off
+    int defer_accept_secs;
+    // TCP_FASTOPEN queue length, 0 turns it off; the request rides on the
+    // SYN when net.ipv4.tcp_fastopen has the server bit (2) set
+    int fastopen_qlen;
+    // SO_RCVBUF on the listener, 0 for autotuning; it has to be set before
+    // listen() to be reflected in the window scale of the handshake
+    int listen_rcvbuf;
+    // we build whole responses, so Nagle would only delay the last segment
+    bool nodelay;
+    // cap on bytes queued but not yet sent; writes beyond it get EAGAIN and
+    // the rest of a large body stays in the file instead of the socket
+    int notsent_lowat;
+    // TCP_CORK around header + file body, so the header does not go out
+    // as a short segment of its own
+    bool cork_files;
+    // bodies at least this large get their send buffer sized from TCP_INFO
+    int size_threshold;
+    // expected per-connection bandwidth in bytes/s, 0 when unknown
+    long path_rate;
+    int max_sndbuf;
+    // SO_LINGER {1, 0}: close() sends RST and throws away whatever is still
+    // queued, the tail of a large response included
+    bool reset_on_close;
+
+    socket_policy()
+        : backlog(0),
+          defer_accept_secs(5),
+          fastopen_qlen(256),
+          listen_rcvbuf(0),
+          nodelay(true),
+          notsent_lowat(128 * 1024),
+          cork_files(true),
+          size_threshold(256 * 1024),
+          path_rate(0),
+          max_sndbuf(16 * 1024 * 1024),
+          reset_on_close(false) {}
+};
+
+// Accepted sockets are cloned from the listener and inherit all of these,
+// so none of them costs a syscall per connection.
+static inline void apply_listen_policy(int listenfd,
+                                       const socket_policy& policy) {
+    if (policy.listen_rcvbuf > 0) {
+        setsockopt(listenfd, SOL_SOCKET, SO_RCVBUF, &policy.listen_rcvbuf,
+                   sizeof(policy.listen_rcvbuf));
+    }
+    if (policy.defer_accept_secs > 0) {
+        setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                   &policy.defer_accept_secs,
+                   sizeof(policy.defer_accept_secs));
+    }
+    if (policy.fastopen_qlen > 0) {
+        setsockopt(listenfd, IPPROTO_TCP, TCP_FASTOPEN, &policy.fastopen_qlen,
+                   sizeof(policy.fastopen_qlen));
+    }
+    if (policy.reset_on_close) {
+        struct linger tmp = {1, 0};
+        setsockopt(listenfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof(tmp));
+    }
+    if (policy.nodelay) {
+        int on = 1;
+        setsockopt(listenfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    if (policy.notsent_lowat > 0) {
+        setsockopt(listenfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                   &policy.notsent_lowat, sizeof(policy.notsent_lowat));
+    }
+}
+
+static inline void set_cork(int connfd, bool on) {
+    int val = on ? 1 : 0;
+    setsockopt(connfd, IPPROTO_TCP, TCP_CORK, &val, sizeof(val));
+}
+
+static inline long read_proc_long(const char* path, long fallback) {
+    long val = fallback;
+    FILE* f = fopen(path, "r");
+    if (f) {
+        if (fscanf(f, "%ld", &val) != 1) {
+            val = fallback;
+        }
+        fclose(f);
+    }
+    return val;
+}
+
+static inline int listen_backlog(const socket_policy& policy) {
+    long somaxconn = read_proc_long("/proc/sys/net/core/somaxconn", SOMAXCONN);
+    if ((policy.backlog <= 0) || (policy.backlog > somaxconn)) {
+        return somaxconn;
+    }
+    return policy.backlog;
+}
+
+// Connections the kernel gave up on because an accept queue was full
+// (ListenOverflows) or for any reason while listening (ListenDrops). They
+// are host-wide counters from /proc/net/netstat: compare two readings.
+struct listen_stats {
+    long overflows;
+    long drops;
+};
+
+static inline bool read_listen_stats(listen_stats* stats) {
+    stats->overflows = stats->drops = 0;
+    FILE* f = fopen("/proc/net/netstat", "r");
+    if (!f) {
+        return false;
+    }
+    // a "TcpExt:" line of names followed by a "TcpExt:" line of values
+    char names[4096], values[4096];
+    bool found = false;
+    while (fgets(names, sizeof(names), f)) {
+        if (strncmp(names, "TcpExt:", 7) != 0) {
+            continue;
+        }
+        if (!fgets(values, sizeof(values), f)) {
+            break;
+        }
+        char* name_save;
+        char* value_save;
+        char* name = strtok_r(names, " \n", &name_save);
+        char* value = strtok_r(values, " \n", &value_save);
+        while (name && value) {
+            if (strcmp(name, "ListenOverflows") == 0) {
+                stats->overflows = atol(value);
+                found = true;
+            } else if (strcmp(name, "ListenDrops") == 0) {
+                stats->drops = atol(value);
+            }
+            name = strtok_r(NULL, " \n", &name_save);
+            value = strtok_r(NULL, " \n", &value_save);
+        }
+        break;
+    }
+    fclose(f);
+    return found;
+}
+
+// TCP_INFO on a listener reports its accept queue: tcpi_unacked is how
+// many connections wait in it, tcpi_sacked the backlog it was given
+static inline void accept_queue(int listenfd, int* queued, int* limit) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    *queued = *limit = 0;
+    if (getsockopt(listenfd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+        *queued = info.tcpi_unacked;
+        *limit = info.tcpi_sacked;
+    }
+}
+
+// The most the kernel's send buffer autotuning will grow to, tcp_wmem[2].
+// Read once; workers racing on the first call store the same value.
+static inline long autotune_sndbuf_cap() {
+    static std::atomic<long> cap(-1);
+    long val = cap.load(std::memory_order_relaxed);
+    if (val == -1) {
+        long min_buf, def_buf, max_buf;
+        FILE* f = fopen("/proc/sys/net/ipv4/tcp_wmem", "r");
+        val = 4 * 1024 * 1024;
+        if (f) {
+            if (fscanf(f, "%ld %ld %ld", &min_buf, &def_buf, &max_buf) == 3) {
+                val = max_buf;
+            }
+            fclose(f);
+        }
+        cap.store(val, std::memory_order_relaxed);
+    }
+    return val;
+}
+
+// The most a plain SO_SNDBUF may ask for, net.core.wmem_max (before the
+// kernel doubles it); only SO_SNDBUFFORCE with CAP_NET_ADMIN goes past it
+static inline long sndbuf_request_cap() {
+    static std::atomic<long> cap(-1);
+    long val = cap.load(std::memory_order_relaxed);
+    if (val == -1) {
+        val = read_proc_long("/proc/sys/net/core/wmem_max", 212992);
+        cap.store(val, std::memory_order_relaxed);
+    }
+    return val;
+}
+
+// Before a large body: the send buffer has to hold a bandwidth-delay
+// product in flight plus the unsent allowance. The delay is the measured
+// smoothed RTT; the bandwidth is path_rate when known, and the current
+// window (cwnd * mss) is the floor either way. Autotuning is kept unless
+// that is more than it will ever grant, and a pin that wmem_max would cut
+// below the autotuning cap is not made at all: SO_SNDBUF also turns
+// autotuning off for good. Returns the SO_SNDBUF it set, 0 if it left the
+// buffer alone.
+static inline int size_send_buffer(int connfd, const socket_policy& policy,
+                                   long body_len) {
+    if (body_len < policy.size_threshold) {
+        return 0;
+    }
+
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if ((getsockopt(connfd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0) ||
+        (info.tcpi_rtt == 0)) {
+        return 0;
+    }
+    long bdp = (long)info.tcpi_snd_cwnd * info.tcpi_snd_mss;
+    long rate_bdp = (long)(policy.path_rate * (info.tcpi_rtt / 1e6));
+    if (rate_bdp > bdp) {
+        bdp = rate_bdp;
+    }
+    long want = bdp + policy.notsent_lowat;
+    if (want > body_len + policy.notsent_lowat) {
+        want = body_len + policy.notsent_lowat;
+    }
+    if (want > policy.max_sndbuf) {
+        want = policy.max_sndbuf;
+    }
+    if (want <= autotune_sndbuf_cap()) {
+        return 0;
+    }
+    int sndbuf = 0;
+    len = sizeof(sndbuf);
+    getsockopt(connfd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len);
+    if (want <= sndbuf) {
+        return 0;
+    }
+
+    // the kernel doubles the value for its bookkeeping overhead
+    int val = want / 2;
+    long request_cap = sndbuf_request_cap();
+    bool forced = (val > request_cap) &&
+                  (setsockopt(connfd, SOL_SOCKET, SO_SNDBUFFORCE, &val,
+                              sizeof(val)) == 0);
+    if (!forced) {
+        if (val > request_cap) {
+            // cut to wmem_max: only worth it if that still beats autotuning
+            if (2 * request_cap <= autotune_sndbuf_cap()) {
+                return 0;
+            }
+            val = request_cap;
+        }
+        setsockopt(connfd, SOL_SOCKET, SO_SNDBUF, &val, sizeof(val));
+    }
+    len = sizeof(sndbuf);
+    getsockopt(connfd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len);
+    return sndbuf;
+}
+
+#endif
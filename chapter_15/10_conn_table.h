@@ -0,0 +1,246 @@
+#ifndef CONN_TABLE_H
+#define CONN_TABLE_H
+
+#include <stddef.h>
+#include <unistd.h>
+
+#include <exception>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "locker.h"
+
+// fd -> connection object, replacing a T per possible fd allocated up front
+// (new T[65536], ~230MB of http_conn in every process that does it).
+// Objects come out of slabs of SLAB_OBJECTS when a connection opens and go
+// back when it closes; a slab that empties is freed, keeping at most one
+// spare. The map is two levels, a page of PAGE_SIZE pointers is allocated
+// the first time an fd in its range shows up.
+//
+// One table per thread that accepts: open(), get(), close() and collect()
+// are for that thread only. A connection that closes is handed back with
+// retire(), from any thread, with its fd still open; the owner's next
+// collect() closes the fd and frees the object. Until then the object stays
+// valid and, since the kernel cannot give the fd number to a new
+// connection, every event for it left in the owner's batch is for the old
+// one.
+template <typename T>
+class conn_table {
+public:
+    static const int PAGE_SHIFT = 8;
+    static const int PAGE_SIZE = 1 << PAGE_SHIFT;
+    static const int SLAB_OBJECTS = 16;
+
+public:
+    conn_table(int max_fd)
+        : m_max_fd(max_fd),
+          m_page_count((max_fd + PAGE_SIZE - 1) >> PAGE_SHIFT),
+          m_pages_used(0),
+          m_slabs(0),
+          m_live(0),
+          m_partial(NULL),
+          m_spare(NULL) {
+        if (max_fd <= 0) {
+            throw std::exception();
+        }
+        m_pages = new T**[m_page_count]();
+    }
+
+    ~conn_table() {
+        collect();
+        for (int i = 0; i < m_page_count; ++i) {
+            if (!m_pages[i]) {
+                continue;
+            }
+            for (int j = 0; j < PAGE_SIZE; ++j) {
+                if (m_pages[i][j]) {
+                    put(m_pages[i][j]);
+                }
+            }
+            delete[] m_pages[i];
+        }
+        delete[] m_pages;
+        delete m_spare;
+    }
+
+    // NULL for an fd with no open connection
+    T* get(int fd) const {
+        if ((fd < 0) || (fd >= m_max_fd)) {
+            return NULL;
+        }
+        T** page = m_pages[fd >> PAGE_SHIFT];
+        return page ? page[fd & (PAGE_SIZE - 1)] : NULL;
+    }
+
+    // a fresh T for fd; whatever the fd mapped to before was already
+    // retired by the thread that closed it
+    T* open(int fd) {
+        if ((fd < 0) || (fd >= m_max_fd)) {
+            return NULL;
+        }
+        T**& page = m_pages[fd >> PAGE_SHIFT];
+        if (!page) {
+            page = new T*[PAGE_SIZE]();
+            m_pages_used++;
+        }
+        T* obj = take();
+        page[fd & (PAGE_SIZE - 1)] = obj;
+        return obj;
+    }
+
+    void close(int fd) {
+        T* obj = get(fd);
+        if (obj) {
+            m_pages[fd >> PAGE_SHIFT][fd & (PAGE_SIZE - 1)] = NULL;
+            put(obj);
+        }
+    }
+
+    void retire(int fd, T* obj) {
+        m_retired_lock.lock();
+        m_retired.push_back(std::make_pair(fd, obj));
+        m_retired_lock.unlock();
+    }
+
+    void collect() {
+        std::vector<std::pair<int, T*> > retired;
+        m_retired_lock.lock();
+        retired.swap(m_retired);
+        m_retired_lock.unlock();
+        for (size_t i = 0; i < retired.size(); ++i) {
+            int fd = retired[i].first;
+            T* obj = retired[i].second;
+            if (get(fd) == obj) {
+                m_pages[fd >> PAGE_SHIFT][fd & (PAGE_SIZE - 1)] = NULL;
+            }
+            put(obj);
+            ::close(fd);
+        }
+    }
+
+    int live() const { return m_live; }
+
+    // slabs and map pages currently held, the spare slab included
+    long bytes() const {
+        return (long)(m_slabs + (m_spare ? 1 : 0)) * sizeof(slab) +
+               (long)m_pages_used * PAGE_SIZE * sizeof(T*) +
+               (long)m_page_count * sizeof(T**);
+    }
+
+    long bytes_per_conn() const {
+        return m_live ? bytes() / m_live : 0;
+    }
+
+private:
+    struct slab;
+
+    struct slot {
+        slab* owner;
+        slot* next_free;
+        // T is constructed here on take() and destroyed on put()
+        alignas(T) unsigned char obj[sizeof(T)];
+    };
+
+    struct slab {
+        slab* prev;
+        slab* next;
+        slot* free;
+        int used;
+        slot slots[SLAB_OBJECTS];
+
+        slab() : prev(NULL), next(NULL), free(NULL), used(0) {
+            for (int i = SLAB_OBJECTS - 1; i >= 0; --i) {
+                slots[i].owner = this;
+                slots[i].next_free = free;
+                free = &slots[i];
+            }
+        }
+    };
+
+    static slot* slot_of(T* obj) {
+        return (slot*)((unsigned char*)obj - offsetof(slot, obj));
+    }
+
+    // m_partial lists the slabs that still have a free slot
+    void link(slab* s) {
+        s->prev = NULL;
+        s->next = m_partial;
+        if (m_partial) {
+            m_partial->prev = s;
+        }
+        m_partial = s;
+    }
+
+    void unlink(slab* s) {
+        if (s->prev) {
+            s->prev->next = s->next;
+        } else {
+            m_partial = s->next;
+        }
+        if (s->next) {
+            s->next->prev = s->prev;
+        }
+        s->prev = s->next = NULL;
+    }
+
+    T* take() {
+        if (!m_partial) {
+            slab* s = m_spare;
+            m_spare = NULL;
+            if (!s) {
+                s = new slab;
+            }
+            m_slabs++;
+            link(s);
+        }
+        slab* s = m_partial;
+        slot* sl = s->free;
+        s->free = sl->next_free;
+        if (!s->free) {
+            unlink(s);
+        }
+        s->used++;
+        m_live++;
+        return new (sl->obj) T();
+    }
+
+    void put(T* obj) {
+        obj->~T();
+        slot* sl = slot_of(obj);
+        slab* s = sl->owner;
+        if (!s->free) {
+            link(s);
+        }
+        sl->next_free = s->free;
+        s->free = sl;
+        s->used--;
+        m_live--;
+        if (s->used > 0) {
+            return;
+        }
+        // one empty slab is kept so a connection opening and closing at
+        // the boundary does not allocate every time
+        unlink(s);
+        m_slabs--;
+        if (m_spare) {
+            delete s;
+        } else {
+            m_spare = s;
+        }
+    }
+
+private:
+    int m_max_fd;
+    int m_page_count;
+    T*** m_pages;
+    int m_pages_used;
+    int m_slabs;
+    int m_live;
+    slab* m_partial;
+    slab* m_spare;
+    locker m_retired_lock;
+    std::vector<std::pair<int, T*> > m_retired;
+};
+
+#endif
@@ -0,0 +1,728 @@
+#ifndef ASYNC_LOG_H
+#define ASYNC_LOG_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <type_traits>
+
+#include "locker.h"
+#include "time_cache.h"
+
+// Logging off the hot path. A call copies the format's address and its
+// arguments into the calling thread's own ring, single producer / single
+// consumer, with no lock, no syscall and no formatting; a flusher thread
+// formats whatever the rings hold and writes it in writev() batches. A
+// full ring drops the line and counts it instead of blocking the caller.
+//
+// Only the format's address is kept, so it must be a string literal.
+// Arguments are numbers, pointers or C strings; strings are copied, and
+// cut to what is left of the record's ARG_SIZE bytes.
+//
+// Levels below LOG_MIN_LEVEL compile to nothing, arguments included:
+//     g++ -DLOG_MIN_LEVEL=LOG_LEVEL_DEBUG ...
+// The names stay clear of the LOG_* priorities of <syslog.h>.
+//
+// Lines go to stdout, to a file rotated by size and age, or to the local
+// syslog socket; see open() and open_syslog(). ALOG_LIMITED() caps what a
+// single call site may log per second.
+//
+// Start it after any fork(): the flusher thread does not exist in a child.
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define ALOG(level, ...)                              \
+    do {                                              \
+        if ((level) >= LOG_MIN_LEVEL) {               \
+            if (0) {                                  \
+                async_log::check_format(__VA_ARGS__); \
+            }                                         \
+            async_log::append((level), __VA_ARGS__);  \
+        }                                             \
+    } while (0)
+
+#define ALOG_DEBUG(...) ALOG(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define ALOG_INFO(...) ALOG(LOG_LEVEL_INFO, __VA_ARGS__)
+#define ALOG_WARN(...) ALOG(LOG_LEVEL_WARN, __VA_ARGS__)
+#define ALOG_ERROR(...) ALOG(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+// For lines that can repeat in a storm, epoll failures or per-connection
+// errors: this call site logs at most burst lines a second and then one in
+// LOG_SAMPLE_EVERY; the first line of a later second reports how many were
+// suppressed. A storm then costs an atomic increment per call instead of
+// a line on disk or in the syslog socket.
+#define LOG_SAMPLE_EVERY 100
+
+#define ALOG_LIMITED(level, burst, ...)                                   \
+    do {                                                                  \
+        if ((level) >= LOG_MIN_LEVEL) {                                   \
+            static log_limit alog_limit;                                  \
+            long alog_suppressed = 0;                                     \
+            if (0) {                                                      \
+                async_log::check_format(__VA_ARGS__);                     \
+            }                                                             \
+            if (alog_limit.allow((burst), &alog_suppressed)) {            \
+                if (alog_suppressed > 0) {                                \
+                    async_log::append((level),                            \
+                                      "%ld similar lines suppressed",     \
+                                      alog_suppressed);                   \
+                }                                                         \
+                async_log::append((level), __VA_ARGS__);                  \
+            }                                                             \
+        }                                                                 \
+    } while (0)
+
+// how an argument waits in a record for the flusher: numbers and pointers
+// by value, unaligned
+template <typename T>
+struct log_arg {
+    static_assert(std::is_scalar<T>::value,
+                  "log arguments are numbers, pointers or C strings");
+    typedef T type;
+    static const int min_size = sizeof(T);
+
+    static char* put(char* p, const char*, T v) {
+        memcpy(p, &v, sizeof(T));
+        return p + sizeof(T);
+    }
+    static T get(const char*& p) {
+        T v;
+        memcpy(&v, p, sizeof(T));
+        p += sizeof(T);
+        return v;
+    }
+};
+
+// strings by content, the caller's buffer may be gone by then; cut to end
+template <>
+struct log_arg<const char*> {
+    typedef const char* type;
+    static const int min_size = 1;
+
+    static char* put(char* p, const char* end, const char* v) {
+        if (!v) {
+            v = "(null)";
+        }
+        const char* last = end - 1;
+        while ((p < last) && *v) {
+            *p++ = *v++;
+        }
+        *p = '\0';
+        return p + 1;
+    }
+    static const char* get(const char*& p) {
+        const char* v = p;
+        p += strlen(p) + 1;
+        return v;
+    }
+};
+
+template <>
+struct log_arg<char*> : log_arg<const char*> {};
+
+// the least room a record needs for these arguments
+template <typename... T>
+struct log_args_size {
+    static const int value = 0;
+};
+
+template <typename T, typename... Rest>
+struct log_args_size<T, Rest...> {
+    static const int value =
+        log_arg<T>::min_size + log_args_size<Rest...>::value;
+};
+
+template <typename... T>
+struct log_types {};
+
+class async_log {
+public:
+    // formatted lines longer than this are cut and keep their '\n'
+    static const int LINE_SIZE = 256;
+    // argument bytes a record holds, see log_arg
+    static const int ARG_SIZE = 224;
+    static const int RING_LINES = 1024;
+    static const int MAX_RINGS = 256;
+    static const int FLUSH_INTERVAL_US = 10000;
+    // datagrams per sendmmsg() to the syslog socket
+    static const int SYSLOG_BATCH = 64;
+    // how long the flusher waits for the syslog daemon to make room
+    static const int SYSLOG_WAIT_MS = 50;
+
+public:
+    // log to path, appended; NULL or never called: stdout. With max_bytes
+    // the file is rotated before a batch would take it past that size,
+    // with max_age_secs once it has been open that long; the old files
+    // are kept as path.1 (newest) to path.keep.
+    static bool open(const char* path, long max_bytes = 0,
+                     int max_age_secs = 0, int keep = 5) {
+        async_log& log = instance();
+        if (!path) {
+            log.m_lock.lock();
+            log.switch_sink(SINK_STDOUT, STDOUT_FILENO);
+            log.m_lock.unlock();
+            return true;
+        }
+        if (strlen(path) >= sizeof(log.m_path)) {
+            return false;
+        }
+        int fd = ::open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            return false;
+        }
+        struct stat st;
+        log.m_lock.lock();
+        log.switch_sink(SINK_FILE, fd);
+        strcpy(log.m_path, path);
+        log.m_max_bytes = max_bytes;
+        log.m_max_age = max_age_secs;
+        log.m_keep = (keep < 1) ? 1 : keep;
+        log.m_size = (fstat(fd, &st) == 0) ? st.st_size : 0;
+        log.m_opened_at = cached_wall_time();
+        log.m_lock.unlock();
+        return true;
+    }
+
+    // one RFC 3164 datagram per line to the local syslog daemon, with the
+    // level as severity. The socket queue is short (net.unix.max_dgram_qlen)
+    // and only the flusher waits on it, up to SYSLOG_WAIT_MS without
+    // progress; what still does not fit is dropped and counted in dropped().
+    static bool open_syslog(const char* ident, int facility = LOG_DAEMON,
+                            const char* socket_path = "/dev/log") {
+        async_log& log = instance();
+        // m_path must also fit sun_path for connect_syslog()
+        if (strlen(socket_path) >= sizeof(((sockaddr_un*)0)->sun_path)) {
+            return false;
+        }
+        log.m_lock.lock();
+        strcpy(log.m_path, socket_path);
+        snprintf(log.m_ident, sizeof(log.m_ident), "%s", ident);
+        log.m_facility = facility;
+        log.m_pid = getpid();
+        int fd = log.connect_syslog();
+        if (fd != -1) {
+            log.switch_sink(SINK_SYSLOG, fd);
+        }
+        log.m_lock.unlock();
+        return fd != -1;
+    }
+
+    // never called, it only has the compiler check ALOG()'s format
+    static void check_format(const char*, ...)
+        __attribute__((format(printf, 1, 2))) {}
+
+    template <typename... Args>
+    static void append(int level, const char* format, Args... args) {
+        static_assert(log_args_size<Args...>::value <= ARG_SIZE,
+                      "too many arguments for one log line");
+        ring*& r = thread_ring();
+        if (!r) {
+            r = instance().add_ring();
+            if (!r) {
+                return;
+            }
+        }
+        unsigned head = r->head.load(std::memory_order_relaxed);
+        if (head - r->tail.load(std::memory_order_acquire) == RING_LINES) {
+            r->dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        record& rec = r->records[head % RING_LINES];
+        rec.level = level;
+        rec.when = cached_wall_time();
+        rec.format = format;
+        rec.print = print_args<Args...>;
+        pack(rec.args, rec.args + ARG_SIZE, args...);
+        r->head.store(head + 1, std::memory_order_release);
+    }
+
+    // writes out everything logged so far and stops the flusher
+    static void stop() {
+        async_log& log = instance();
+        log.m_lock.lock();
+        bool running = log.m_running;
+        log.m_running = false;
+        log.m_lock.unlock();
+        if (running) {
+            log.m_stop = true;
+            pthread_join(log.m_thread, NULL);
+        }
+        log.flush();
+    }
+
+    static long dropped() {
+        async_log& log = instance();
+        long total = 0;
+        int count = log.m_ring_count.load(std::memory_order_acquire);
+        for (int i = 0; i < count; ++i) {
+            total += log.m_rings[i]->dropped.load(std::memory_order_relaxed);
+        }
+        return total + log.m_sink_dropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    static const int STAMP_LEN = 20;  // "2024-01-01 00:00:00 "
+    static const int LEVEL_LEN = 6;   // "INFO  "
+
+    enum SINK { SINK_STDOUT = 0, SINK_FILE, SINK_SYSLOG };
+
+    typedef int (*printer)(char* out, int size, const char* format,
+                           const char* args);
+
+    // a call as append() left it, 256 bytes
+    struct record {
+        int level;
+        time_t when;
+        const char* format;
+        printer print;
+        char args[ARG_SIZE];
+    };
+
+    // a record as the flusher formatted it
+    struct line {
+        int len;
+        int level;
+        char text[LINE_SIZE];
+    };
+
+    // head is only written by the owning thread, tail only by the flusher
+    struct ring {
+        std::atomic<unsigned> head;
+        char pad[64 - sizeof(std::atomic<unsigned>)];
+        std::atomic<unsigned> tail;
+        std::atomic<long> dropped;
+        record records[RING_LINES];
+
+        ring() : head(0), tail(0), dropped(0) {}
+    };
+
+    async_log()
+        : m_sink(SINK_STDOUT),
+          m_fd(STDOUT_FILENO),
+          m_max_bytes(0),
+          m_max_age(0),
+          m_keep(1),
+          m_size(0),
+          m_opened_at(0),
+          m_facility(LOG_DAEMON),
+          m_pid(0),
+          m_sink_dropped(0),
+          m_stamped(-1),
+          m_ring_count(0),
+          m_running(false),
+          m_stop(false) {
+        m_path[0] = '\0';
+        m_ident[0] = '\0';
+    }
+
+    static async_log& instance() {
+        static async_log log;
+        return log;
+    }
+
+    // a function-local static, so every translation unit shares it
+    static ring*& thread_ring() {
+        static __thread ring* r = NULL;
+        return r;
+    }
+
+    static const char* level_name(int level) {
+        static const char* names[] = {"DEBUG ", "INFO  ", "WARN  ", "ERROR "};
+        return names[(level < 0) ? 0 : (level > 3) ? 3 : level];
+    }
+
+    // each argument after the one before it, strings get what the rest
+    // leave them
+    static void pack(char*, const char*) {}
+
+    template <typename T, typename... Rest>
+    static void pack(char* p, const char* end, T v, Rest... rest) {
+        p = log_arg<T>::put(p, end - log_args_size<Rest...>::value, v);
+        pack(p, end, rest...);
+    }
+
+    // on the flusher: the arguments back out of the record, in order, and
+    // into snprintf() as the call site passed them
+    template <typename... Args>
+    static int print_args(char* out, int size, const char* format,
+                          const char* args) {
+        return unpack(log_types<Args...>(), out, size, format, args);
+    }
+
+    template <typename... Done>
+    static int unpack(log_types<>, char* out, int size, const char* format,
+                      const char*, Done... done) {
+        return print(out, size, format, done...);
+    }
+
+    template <typename T, typename... Rest, typename... Done>
+    static int unpack(log_types<T, Rest...>, char* out, int size,
+                      const char* format, const char* p, Done... done) {
+        typename log_arg<T>::type v = log_arg<T>::get(p);
+        return unpack(log_types<Rest...>(), out, size, format, p, done...,
+                      v);
+    }
+
+    static int print(char* out, int size, const char* format, ...) {
+        va_list arg_list;
+        va_start(arg_list, format);
+        int n = vsnprintf(out, size, format, arg_list);
+        va_end(arg_list);
+        return n;
+    }
+
+    // on the flusher: stamp, level, message and one '\n'
+    void format(const record& rec, line* l) {
+        char* buf = l->text;
+        if (rec.when != m_stamped) {
+            struct tm tm;
+            localtime_r(&rec.when, &tm);
+            strftime(m_stamp, sizeof(m_stamp), "%Y-%m-%d %H:%M:%S ", &tm);
+            m_stamped = rec.when;
+        }
+        memcpy(buf, m_stamp, STAMP_LEN);
+        memcpy(buf + STAMP_LEN, level_name(rec.level), LEVEL_LEN);
+        int len = STAMP_LEN + LEVEL_LEN;
+
+        int n = rec.print(buf + len, LINE_SIZE - len, rec.format, rec.args);
+        if (n < 0) {
+            n = 0;
+        }
+        len += n;
+        if (len >= LINE_SIZE) {
+            len = LINE_SIZE - 1;
+        }
+        // formats that already end in a newline keep just the one
+        if ((len == STAMP_LEN + LEVEL_LEN) || (buf[len - 1] != '\n')) {
+            if (len == LINE_SIZE - 1) {
+                len--;
+            }
+            buf[len++] = '\n';
+        }
+        l->len = len;
+        l->level = rec.level;
+    }
+
+    // the calling thread's first line: a ring of its own, and the flusher
+    // if this is the first ring at all
+    ring* add_ring() {
+        m_lock.lock();
+        int count = m_ring_count.load(std::memory_order_relaxed);
+        if (count == MAX_RINGS) {
+            m_lock.unlock();
+            return NULL;
+        }
+        ring* r = new ring;
+        m_rings[count] = r;
+        m_ring_count.store(count + 1, std::memory_order_release);
+        if (!m_running && !m_stop &&
+            (pthread_create(&m_thread, NULL, flusher, this) == 0)) {
+            m_running = true;
+            atexit(stop_at_exit);
+        }
+        m_lock.unlock();
+        return r;
+    }
+
+    static void stop_at_exit() { stop(); }
+
+    static void* flusher(void* arg) {
+        async_log* log = (async_log*)arg;
+        while (!log->m_stop) {
+            if (log->flush() == 0) {
+                usleep(FLUSH_INTERVAL_US);
+            }
+        }
+        return NULL;
+    }
+
+    // up to IOV_MAX lines a batch, formatted into m_out; a slot is handed
+    // back only after the sink is done with its line
+    int flush() {
+        line* batch[IOV_MAX];
+        unsigned upto[MAX_RINGS];
+        int written = 0;
+        int count = m_ring_count.load(std::memory_order_acquire);
+        bool more = true;
+        while (more) {
+            more = false;
+            int n = 0;
+            int i = 0;
+            for (; (i < count) && (n < IOV_MAX); ++i) {
+                ring* r = m_rings[i];
+                unsigned tail = r->tail.load(std::memory_order_relaxed);
+                unsigned head = r->head.load(std::memory_order_acquire);
+                for (; (tail != head) && (n < IOV_MAX); ++tail, ++n) {
+                    batch[n] = &m_out[n];
+                    format(r->records[tail % RING_LINES], batch[n]);
+                }
+                upto[i] = tail;
+                more = more || (tail != head);
+            }
+            if (n == 0) {
+                break;
+            }
+            m_lock.lock();
+            if (m_sink == SINK_SYSLOG) {
+                send_syslog(batch, n);
+            } else {
+                write_lines(batch, n);
+            }
+            m_lock.unlock();
+            for (int j = 0; j < i; ++j) {
+                m_rings[j]->tail.store(upto[j], std::memory_order_release);
+            }
+            written += n;
+            more = more || (i < count);
+        }
+        return written;
+    }
+
+    // with m_lock held
+    void switch_sink(SINK sink, int fd) {
+        if (m_fd != STDOUT_FILENO) {
+            close(m_fd);
+        }
+        m_sink = sink;
+        m_fd = fd;
+    }
+
+    void write_lines(line** batch, int n) {
+        struct iovec iv[IOV_MAX];
+        long bytes = 0;
+        for (int i = 0; i < n; ++i) {
+            iv[i].iov_base = batch[i]->text;
+            iv[i].iov_len = batch[i]->len;
+            bytes += batch[i]->len;
+        }
+        if (m_sink == SINK_FILE) {
+            rotate_if_due(bytes);
+            m_size += bytes;
+        }
+        write_all(iv, n);
+    }
+
+    void write_all(struct iovec* iv, int n) {
+        while (n > 0) {
+            ssize_t ret = writev(m_fd, iv, n);
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            while ((n > 0) && ((size_t)ret >= iv->iov_len)) {
+                ret -= iv->iov_len;
+                iv++;
+                n--;
+            }
+            if (n > 0) {
+                iv->iov_base = (char*)iv->iov_base + ret;
+                iv->iov_len -= ret;
+            }
+        }
+    }
+
+    // path.keep falls off the end, path becomes path.1
+    void rotate_if_due(long bytes) {
+        time_t now = cached_wall_time();
+        bool full = (m_max_bytes > 0) && (m_size > 0) &&
+                    (m_size + bytes > m_max_bytes);
+        bool old = (m_max_age > 0) && (now - m_opened_at >= m_max_age);
+        if (!full && !old) {
+            return;
+        }
+        char from[sizeof(m_path) + 16];
+        char to[sizeof(m_path) + 16];
+        for (int i = m_keep - 1; i >= 1; --i) {
+            snprintf(from, sizeof(from), "%s.%d", m_path, i);
+            snprintf(to, sizeof(to), "%s.%d", m_path, i + 1);
+            rename(from, to);
+        }
+        snprintf(to, sizeof(to), "%s.1", m_path);
+        rename(m_path, to);
+        int fd =
+            ::open(m_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            // keep appending to the renamed file rather than lose lines
+            return;
+        }
+        close(m_fd);
+        m_fd = fd;
+        m_size = 0;
+        m_opened_at = now;
+    }
+
+    int connect_syslog() {
+        int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+            return -1;
+        }
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, m_path, strlen(m_path) + 1);
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    static int severity(int level) {
+        switch (level) {
+            case LOG_LEVEL_DEBUG:
+                return LOG_DEBUG;
+            case LOG_LEVEL_INFO:
+                return LOG_INFO;
+            case LOG_LEVEL_WARN:
+                return LOG_WARNING;
+            default:
+                return LOG_ERR;
+        }
+    }
+
+    // "<pri>Oct 18 21:05:57 ident[pid]: " ahead of each message, without
+    // our own stamp, level or newline
+    void send_syslog(line** batch, int n) {
+        struct mmsghdr msgs[SYSLOG_BATCH];
+        struct iovec iv[SYSLOG_BATCH][2];
+        char head[SYSLOG_BATCH][64];
+        char stamp[32];
+        time_t now = cached_wall_time();
+        struct tm tm;
+        localtime_r(&now, &tm);
+        strftime(stamp, sizeof(stamp), "%b %e %H:%M:%S", &tm);
+
+        for (int done = 0; done < n; done += SYSLOG_BATCH) {
+            int k = (n - done < SYSLOG_BATCH) ? n - done : SYSLOG_BATCH;
+            memset(msgs, 0, sizeof(msgs[0]) * k);
+            for (int i = 0; i < k; ++i) {
+                line* l = batch[done + i];
+                int skip = STAMP_LEN + LEVEL_LEN;
+                int len = l->len - skip;
+                if ((len > 0) && (l->text[skip + len - 1] == '\n')) {
+                    len--;
+                }
+                int head_len = snprintf(
+                    head[i], sizeof(head[i]), "<%d>%s %s[%d]: ",
+                    m_facility | severity(l->level), stamp, m_ident, m_pid);
+                if (head_len >= (int)sizeof(head[i])) {
+                    head_len = sizeof(head[i]) - 1;
+                }
+                iv[i][0].iov_base = head[i];
+                iv[i][0].iov_len = head_len;
+                iv[i][1].iov_base = l->text + skip;
+                iv[i][1].iov_len = (len > 0) ? len : 0;
+                msgs[i].msg_hdr.msg_iov = iv[i];
+                msgs[i].msg_hdr.msg_iovlen = 2;
+            }
+            int sent = 0;
+            while (sent < k) {
+                int ret = sendmmsg(m_fd, msgs + sent, k - sent,
+                                   MSG_DONTWAIT | MSG_NOSIGNAL);
+                if (ret > 0) {
+                    sent += ret;
+                    continue;
+                }
+                if ((ret < 0) && (errno == EINTR)) {
+                    continue;
+                }
+                if ((ret < 0) && (errno == EAGAIN)) {
+                    struct pollfd pfd = {m_fd, POLLOUT, 0};
+                    if (poll(&pfd, 1, SYSLOG_WAIT_MS) > 0) {
+                        continue;
+                    }
+                } else if ((ret < 0) &&
+                           ((errno == ECONNREFUSED) || (errno == ENOTCONN))) {
+                    // the daemon restarted and bound a new socket
+                    int fd = connect_syslog();
+                    if (fd != -1) {
+                        close(m_fd);
+                        m_fd = fd;
+                    }
+                }
+                break;
+            }
+            m_sink_dropped.fetch_add(k - sent, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    // the sink, guarded by m_lock: open*() may switch it while logging
+    SINK m_sink;
+    int m_fd;
+    char m_path[PATH_MAX];
+    long m_max_bytes;
+    int m_max_age;
+    int m_keep;
+    long m_size;
+    time_t m_opened_at;
+    char m_ident[32];
+    int m_facility;
+    pid_t m_pid;
+    std::atomic<long> m_sink_dropped;
+
+    // the flusher's own: lines of the batch in hand, and the last stamp
+    line m_out[IOV_MAX];
+    char m_stamp[STAMP_LEN + 1];
+    time_t m_stamped;
+
+    ring* m_rings[MAX_RINGS];
+    std::atomic<int> m_ring_count;
+    locker m_lock;
+    pthread_t m_thread;
+    bool m_running;
+    std::atomic<bool> m_stop;
+};
+
+// ALOG_LIMITED() keeps one of these per call site
+struct log_limit {
+    std::atomic<time_t> window;
+    std::atomic<long> seen;
+    std::atomic<long> suppressed;
+
+    log_limit() : window(0), seen(0), suppressed(0) {}
+
+    // *reported: lines suppressed in the seconds before this one, for the
+    // caller to mention once
+    bool allow(long burst, long* reported) {
+        time_t now = cached_time();
+        time_t w = window.load(std::memory_order_relaxed);
+        if ((w != now) && window.compare_exchange_strong(w, now)) {
+            seen.store(0, std::memory_order_relaxed);
+            *reported = suppressed.exchange(0);
+        }
+        long n = seen.fetch_add(1, std::memory_order_relaxed);
+        if ((n < burst) ||
+            ((n - burst) % LOG_SAMPLE_EVERY == LOG_SAMPLE_EVERY - 1)) {
+            return true;
+        }
+        suppressed.fetch_add(1 + *reported, std::memory_order_relaxed);
+        *reported = 0;
+        return false;
+    }
+};
+
+#endif
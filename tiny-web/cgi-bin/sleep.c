@@ -0,0 +1,22 @@
+/*
+ * sleep.c - a slow CGI program: waits QUERY_STRING seconds (2 if
+ *     unset) before answering, like a script stuck on a database
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+int main(void)
+{
+    char *buf;
+    int secs = 2;
+
+    if ((buf = getenv("QUERY_STRING")) != NULL && *buf)
+        secs = atoi(buf);
+    sleep(secs);
+
+    printf("Content-type: text/plain\r\n\r\n");
+    printf("slept %d seconds in pid %d\n", secs, getpid());
+    fflush(stdout);
+    exit(0);
+}
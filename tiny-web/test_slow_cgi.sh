@@ -0,0 +1,69 @@
+#!/bin/bash
+#
+# While a few slow CGI requests are running, static requests must still be
+# answered right away. Usage: ./test_slow_cgi.sh [port]
+
+PORT=${1:-8080}
+SLOW=4          # concurrent cgi-bin/sleep requests
+SLEEP=3         # seconds each of them takes
+STATIC=20       # static requests sent meanwhile
+LIMIT=1         # seconds a static request may take
+
+SRC=$(cd "$(dirname "$0")" && pwd)
+DIR=$(mktemp -d)
+trap 'kill $SERVER_PID 2>/dev/null; rm -rf "$DIR"' EXIT
+
+echo "Compiling tiny and cgi-bin/sleep..."
+# tiny.c includes csapp.h, the header in this directory is caspp.h
+cp "$SRC/caspp.h" "$DIR/csapp.h"
+mkdir "$DIR/cgi-bin"
+gcc -O2 -I"$DIR" -o "$DIR/tiny" "$SRC/tiny.c" "$SRC/csapp.c" -pthread &&
+    gcc -O2 -o "$DIR/cgi-bin/sleep" "$SRC/cgi-bin/sleep.c"
+if [ $? -ne 0 ]; then
+    echo "Compilation failed!"
+    exit 1
+fi
+echo "<html><body>tiny</body></html>" > "$DIR/home.html"
+
+echo "Starting server on port $PORT..."
+cd "$DIR"
+./tiny "$PORT" > /dev/null &
+SERVER_PID=$!
+sleep 1
+
+echo "Starting $SLOW CGI requests of ${SLEEP}s..."
+for i in $(seq $SLOW); do
+    curl -s -o /dev/null -w "%{http_code} %{time_total}\n" \
+        "http://127.0.0.1:$PORT/cgi-bin/sleep?$SLEEP" > "$DIR/slow.$i" &
+    CLIENTS="$CLIENTS $!"
+done
+sleep 0.5
+
+echo "Sending $STATIC static requests..."
+for i in $(seq $STATIC); do
+    curl -s -o /dev/null -w "%{http_code} %{time_total}\n" \
+        "http://127.0.0.1:$PORT/home.html" > "$DIR/static.$i" &
+    CLIENTS="$CLIENTS $!"
+done
+wait $CLIENTS
+
+FAILED=0
+echo "CGI requests (status, seconds):"
+cat "$DIR"/slow.*
+echo "Fastest and slowest static requests (status, seconds):"
+cat "$DIR"/static.* | sort -k2 -n | sed -n '1p;$p'
+if grep -qv "^200 " "$DIR"/slow.* "$DIR"/static.*; then
+    echo "Some requests failed"
+    FAILED=1
+fi
+if awk -v limit=$LIMIT '$2 > limit { bad = 1 } END { exit !bad }' \
+        "$DIR"/static.*; then
+    echo "Static requests waited for the CGI programs"
+    FAILED=1
+fi
+
+if [ $FAILED -ne 0 ]; then
+    echo "Test failed."
+    exit 1
+fi
+echo "Test passed."
@@ -1,23 +1,87 @@
 /*
- * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the
+ * tiny.c - A simple, event-driven HTTP/1.1 Web server that uses the
  *     GET method to serve static and dynamic content
+ *
+ * One thread runs an epoll loop over non-blocking connections. Each
+ * connection keeps its own input buffer and pending output, so a slow
+ * client only holds up itself. Connections persist as HTTP/1.1 says:
+ * kept alive unless the client sends "Connection: close", while
+ * HTTP/1.0 clients have to ask for keep-alive. Static files are sent
+ * with sendfile, corked behind their headers so both leave in the same
+ * segments.
+ *
+ * CGI programs run asynchronously: their stdout is a pipe watched by
+ * the same loop, and output is relayed to the client as it arrives.
+ * Children are reaped through a signalfd for SIGCHLD.
  */
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
 #include "csapp.h"
 
-void doit(int fd);
-void read_requesthdrs(rio_t *rp);
+#define MAXEVENTS 64
+#define MAXCGI    64   /* CGI programs running at once */
+
+/* Append-only text buffer; each append costs only the bytes it adds */
+typedef struct {
+    char *buf;
+    int len;
+    int size;
+} strbuf_t;
+
+/* Per-connection state, found through fdtab by socket or CGI pipe */
+typedef struct {
+    int fd;
+    char in[MAXLINE];      /* Request bytes not consumed yet */
+    int in_len;
+    char out[MAXBUF];      /* Response bytes not sent yet */
+    int out_len;
+    int out_off;
+    int filefd;            /* Static body still to sendfile, or -1 */
+    off_t file_off;
+    off_t file_end;
+    int corked;            /* TCP_CORK held until the body is out */
+    int pipefd;            /* Stdout of a running CGI program, or -1 */
+    int http11;            /* Client spoke HTTP/1.1 */
+    int keepalive;         /* Reuse the connection after this response */
+    int responding;        /* A response has been started */
+    int eof;               /* Client closed its side */
+    int events;            /* What fd is registered for */
+    int pipe_events;       /* EPOLLIN while pipefd is in the epoll set */
+} conn_t;
+
+static int epfd;
+static int ncgi;
+static conn_t **fdtab;
+static int fdtab_size;
+
+void accept_conns(int listenfd);
+void read_conn(conn_t *c);
+void service(conn_t *c);
+int flush_conn(conn_t *c);
+void close_conn(conn_t *c);
+void update_events(conn_t *c);
+int next_request(conn_t *c);
+void doit(conn_t *c, char *hdrs);
 int parse_uri(char *uri, char *filename, char *cgiargs);
-void serve_static(int fd, char *filename, int filesize);
+void serve_static(conn_t *c, char *filename, int filesize);
 void get_filetype(char *filename, char *filetype);
-void serve_dynamic(int fd, char *filename, char *cgiargs);
-void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg);
+void serve_dynamic(conn_t *c, char *filename, char *cgiargs);
+void relay_cgi(conn_t *c);
+void reap_cgis(int sigfd);
+void clienterror(conn_t *c, char *cause, char *errnum, char *shortmsg, char *longmsg);
+void sb_init(strbuf_t *sb, char *buf, int size);
+void sb_printf(strbuf_t *sb, const char *fmt, ...);
+void start_response(conn_t *c, strbuf_t *sb, char *status, char *reason);
+void set_cork(conn_t *c, int on);
 
 int main(int argc, char **argv)
 {
-    int listenfd, connfd;
-    char hostname[MAXLINE], port[MAXLINE];
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
+    int listenfd, sigfd, fd, i, n;
+    struct epoll_event ev, events[MAXEVENTS];
+    sigset_t mask;
+    conn_t *c;
 
     /* Check command-line args */
     if (argc != 2) {
@@ -25,97 +89,383 @@ int main(int argc, char **argv)
         exit(1);
     }
 
+    fdtab_size = sysconf(_SC_OPEN_MAX);
+    fdtab = Calloc(fdtab_size, sizeof(conn_t *));
+
+    /* SIGCHLD is delivered through a descriptor and reaped in the loop */
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGCHLD);
+    Sigprocmask(SIG_BLOCK, &mask, NULL);
+    if ((sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+        unix_error("signalfd error");
+    /* Write errors are handled where they happen */
+    Signal(SIGPIPE, SIG_IGN);
+
     listenfd = Open_listenfd(argv[1]);
+    /* A CGI program must not inherit it */
+    fcntl(listenfd, F_SETFD, FD_CLOEXEC);
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        unix_error("epoll_create1 error");
+    ev.events = EPOLLIN;
+    ev.data.fd = listenfd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    ev.data.fd = sigfd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev) < 0)
+        unix_error("epoll_ctl error");
+
+    while (1) {
+        if ((n = epoll_wait(epfd, events, MAXEVENTS, -1)) < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("epoll_wait error");
+        }
+        for (i = 0; i < n; i++) {
+            fd = events[i].data.fd;
+            if (fd == sigfd) {
+                reap_cgis(sigfd);
+            }
+            else if (fd == listenfd) {
+                accept_conns(listenfd);
+            }
+            else if ((c = fdtab[fd]) == NULL) {
+                continue;  /* Closed earlier in this round */
+            }
+            else if (fd == c->pipefd) {
+                relay_cgi(c);
+            }
+            else if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                close_conn(c);
+            }
+            else {
+                if (events[i].events & EPOLLIN)
+                    read_conn(c);
+                service(c);
+            }
+        }
+    }
+}
+
+/*
+ * accept_conns - accept every pending connection
+ */
+void accept_conns(int listenfd)
+{
+    int connfd;
+    char hostname[MAXLINE], port[MAXLINE];
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
+    struct epoll_event ev;
+    conn_t *c;
+
     while (1) {
         clientlen = sizeof(clientaddr);
-        connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+        connfd = accept(listenfd, (SA *)&clientaddr, &clientlen);
+        if (connfd < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                fprintf(stderr, "accept error: %s\n", strerror(errno));
+            return;
+        }
+        /* Close-on-exec keeps it out of CGI programs run for others */
+        fcntl(connfd, F_SETFD, FD_CLOEXEC);
+        fcntl(connfd, F_SETFL, O_NONBLOCK);
+        if (connfd >= fdtab_size) {
+            Close(connfd);
+            continue;
+        }
+        /* Numeric only, a reverse lookup would stall every client */
         Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE,
-                    port, MAXLINE, 0);
+                    port, MAXLINE, NI_NUMERICHOST | NI_NUMERICSERV);
         printf("Accepted connection from (%s, %s)\n", hostname, port);
-        doit(connfd);
-        Close(connfd);
+
+        c = Malloc(sizeof(conn_t));
+        c->fd = connfd;
+        c->in_len = c->out_len = c->out_off = 0;
+        c->in[0] = '\0';
+        c->filefd = c->pipefd = -1;
+        c->corked = 0;
+        c->http11 = c->keepalive = c->responding = c->eof = 0;
+        c->events = EPOLLIN;
+        c->pipe_events = 0;
+        fdtab[connfd] = c;
+        ev.events = EPOLLIN;
+        ev.data.fd = connfd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &ev) < 0)
+            unix_error("epoll_ctl error");
+    }
+}
+
+/*
+ * read_conn - read whatever the client has sent, up to a full buffer
+ */
+void read_conn(conn_t *c)
+{
+    ssize_t n;
+
+    while (c->in_len < MAXLINE - 1) {
+        n = read(c->fd, c->in + c->in_len, MAXLINE - 1 - c->in_len);
+        if (n > 0) {
+            c->in_len += n;
+        }
+        else if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        else {
+            if (n == 0 || errno != EAGAIN)
+                c->eof = 1;
+            break;
+        }
+    }
+    c->in[c->in_len] = '\0';
+}
+
+/*
+ * service - push the current response along and start the next
+ *     buffered request once it is done
+ */
+void service(conn_t *c)
+{
+    while (1) {
+        if (c->responding) {
+            if (!flush_conn(c))
+                return;
+            if (c->out_len || c->filefd != -1 || c->pipefd != -1)
+                break;
+            c->responding = 0;
+            if (!c->keepalive) {
+                close_conn(c);
+                return;
+            }
+        }
+        if (!next_request(c)) {
+            if (c->eof) {
+                close_conn(c);
+                return;
+            }
+            break;
+        }
+    }
+    update_events(c);
+}
+
+/*
+ * flush_conn - write pending output until done or the socket is full.
+ *     Returns 0 if the connection had to be closed.
+ */
+int flush_conn(conn_t *c)
+{
+    ssize_t n;
+
+    while (c->out_off < c->out_len) {
+        n = write(c->fd, c->out + c->out_off, c->out_len - c->out_off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                return 1;
+            close_conn(c);
+            return 0;
+        }
+        c->out_off += n;
+    }
+    c->out_len = c->out_off = 0;
+
+    while (c->filefd != -1 && c->file_off < c->file_end) {
+        n = sendfile(c->fd, c->filefd, &c->file_off,
+                     c->file_end - c->file_off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                return 1;
+            close_conn(c);
+            return 0;
+        }
+        if (n == 0) {  /* File shrank under us, length already promised */
+            close_conn(c);
+            return 0;
+        }
+    }
+    if (c->filefd != -1) {
+        Close(c->filefd);
+        c->filefd = -1;
+        set_cork(c, 0);  /* Push out the tail of the body */
+    }
+    return 1;
+}
+
+/*
+ * close_conn - release a connection; a CGI program still writing to it
+ *     gets SIGPIPE
+ */
+void close_conn(conn_t *c)
+{
+    if (c->filefd != -1)
+        Close(c->filefd);
+    if (c->pipefd != -1) {
+        fdtab[c->pipefd] = NULL;
+        Close(c->pipefd);
+        ncgi--;
+    }
+    fdtab[c->fd] = NULL;
+    Close(c->fd);  /* Also drops it from the epoll set */
+    Free(c);
+}
+
+/*
+ * update_events - wait for writability while output is pending,
+ *     otherwise for the next request or the next piece of CGI output
+ */
+void update_events(conn_t *c)
+{
+    struct epoll_event ev;
+    int events, pipe_events;
+
+    if (c->out_len || c->filefd != -1)
+        events = EPOLLOUT;
+    else
+        events = c->pipefd == -1 ? EPOLLIN : 0;
+    if (events != c->events) {
+        ev.events = events;
+        ev.data.fd = c->fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+            unix_error("epoll_ctl error");
+        c->events = events;
+    }
+
+    /*
+     * Leave CGI output in the pipe until the client takes the last batch.
+     * The pipe leaves the epoll set meanwhile: an empty mask would still
+     * report EPOLLHUP once the program exits, on every epoll_wait.
+     */
+    pipe_events = c->out_len ? 0 : EPOLLIN;
+    if (c->pipefd != -1 && pipe_events != c->pipe_events) {
+        ev.events = pipe_events;
+        ev.data.fd = c->pipefd;
+        if (epoll_ctl(epfd, pipe_events ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+                      c->pipefd, &ev) < 0)
+            unix_error("epoll_ctl error");
+        c->pipe_events = pipe_events;
+    }
+}
+
+/*
+ * next_request - start the response to the next complete request in
+ *     the input buffer. Returns 0 if there is none yet.
+ */
+int next_request(conn_t *c)
+{
+    char *end;
+    int len;
+
+    if (!(end = strstr(c->in, "\r\n\r\n"))) {
+        if (c->in_len < MAXLINE - 1)
+            return 0;
+        c->http11 = c->keepalive = 0;
+        c->responding = 1;
+        c->in_len = 0;
+        c->in[0] = '\0';
+        clienterror(c, "request", "400", "Bad Request",
+                    "Tiny couldn't find the end of the request headers");
+        return 1;
     }
+
+    len = end + 4 - c->in;
+    end[2] = '\0';
+    c->responding = 1;
+    doit(c, c->in);
+    /* Keep pipelined requests for later */
+    memmove(c->in, c->in + len, c->in_len - len + 1);
+    c->in_len -= len;
+    return 1;
 }
 
-void doit(int fd)
+/*
+ * doit - handle one HTTP request/response transaction; hdrs holds the
+ *     request line and headers, each ending in CRLF
+ */
+void doit(conn_t *c, char *hdrs)
 {
     int is_static;
     struct stat sbuf;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
     char filename[MAXLINE], cgiargs[MAXLINE];
-    rio_t rio;
+    char *line, *value;
 
-    /* Read request line and headers */
-    Rio_readinitb(&rio, fd);
-    Rio_readlineb(&rio, buf, MAXLINE);
     printf("Request headers:\n");
-    printf("%s", buf);
-    sscanf(buf, "%s %s %s", method, uri, version);
+    printf("%s", hdrs);
+    method[0] = uri[0] = version[0] = '\0';
+    sscanf(hdrs, "%s %s %s", method, uri, version);
+
+    /* HTTP/1.1 defaults to keep-alive, HTTP/1.0 has to ask for it */
+    c->http11 = !strcmp(version, "HTTP/1.1");
+    c->keepalive = c->http11;
+    for (line = strstr(hdrs, "\r\n"); line; line = strstr(line, "\r\n")) {
+        line += 2;
+        if (strncasecmp(line, "Connection:", 11))
+            continue;
+        value = line + 11;
+        if (!strncasecmp(value + strspn(value, " \t"), "close", 5))
+            c->keepalive = 0;
+        else if (!strncasecmp(value + strspn(value, " \t"), "keep-alive", 10))
+            c->keepalive = 1;
+    }
+
     if (strcasecmp(method, "GET")) {
-        clienterror(fd, method, "501", "Not Implemented",
+        clienterror(c, method, "501", "Not Implemented",
                     "Tiny does not implement this method");
         return;
     }
-    read_requesthdrs(&rio);
 
     /* Parse URI from GET request */
     is_static = parse_uri(uri, filename, cgiargs);
     if (stat(filename, &sbuf) < 0) {
-        clienterror(fd, filename, "404", "Not found",
+        clienterror(c, filename, "404", "Not found",
                     "Tiny couldn't find this file");
         return;
     }
 
     if (is_static) { /* Serve static content */
         if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-            clienterror(fd, filename, "403", "Forbidden",
+            clienterror(c, filename, "403", "Forbidden",
                         "Tiny couldn't read the file");
             return;
         }
-        serve_static(fd, filename, sbuf.st_size);
+        serve_static(c, filename, sbuf.st_size);
     }
     else { /* Serve dynamic content */
         if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
-            clienterror(fd, filename, "403", "Forbidden",
+            clienterror(c, filename, "403", "Forbidden",
                         "Tiny couldn't run the CGI program");
             return;
         }
-        serve_dynamic(fd, filename, cgiargs);
+        serve_dynamic(c, filename, cgiargs);
     }
 }
 
-void clienterror(int fd, char *cause, char *errnum,
+void clienterror(conn_t *c, char *cause, char *errnum,
                  char *shortmsg, char *longmsg)
 {
-    char buf[MAXLINE], body[MAXBUF];
+    char body[MAXBUF];
+    strbuf_t sb, bsb;
 
     /* Build the HTTP response body */
-    sprintf(body, "<html><title>Tiny Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
-
-    /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
-}
-
-void read_requesthdrs(rio_t *rp)
-{
-    char buf[MAXLINE];
+    sb_init(&bsb, body, MAXBUF);
+    sb_printf(&bsb, "<html><title>Tiny Error</title>");
+    sb_printf(&bsb, "<body bgcolor=""ffffff"">\r\n");
+    sb_printf(&bsb, "%s: %s\r\n", errnum, shortmsg);
+    sb_printf(&bsb, "<p>%s: %.512s\r\n", longmsg, cause);
+    sb_printf(&bsb, "<hr><em>The Tiny Web server</em>\r\n");
 
-    Rio_readlineb(rp, buf, MAXLINE);
-    while(strcmp(buf, "\r\n")) {
-        Rio_readlineb(rp, buf, MAXLINE);
-        printf("%s", buf);
-    }
-    return;
+    /* Queue headers and body back to back, they go out in one write */
+    sb_init(&sb, c->out, MAXBUF);
+    start_response(c, &sb, errnum, shortmsg);
+    sb_printf(&sb, "Content-type: text/html\r\n");
+    sb_printf(&sb, "Content-length: %d\r\n\r\n", bsb.len);
+    sb_printf(&sb, "%s", body);
+    c->out_len = sb.len;
+    c->out_off = 0;
 }
 
 int parse_uri(char *uri, char *filename, char *cgiargs)
@@ -144,28 +494,35 @@ int parse_uri(char *uri, char *filename, char *cgiargs)
     }
 }
 
-void serve_static(int fd, char *filename, int filesize)
+void serve_static(conn_t *c, char *filename, int filesize)
 {
     int srcfd;
-    char *srcp, filetype[MAXLINE], buf[MAXBUF];
+    char filetype[MAXLINE];
+    strbuf_t sb;
 
-    /* Send response headers to client */
+    if ((srcfd = open(filename, O_RDONLY | O_CLOEXEC)) < 0) {
+        clienterror(c, filename, "403", "Forbidden",
+                    "Tiny couldn't read the file");
+        return;
+    }
+
+    /* Queue response headers, the body follows with sendfile */
     get_filetype(filename, filetype);
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    sprintf(buf, "%sServer: Tiny Web Server\r\n", buf);
-    sprintf(buf, "%sConnection: close\r\n", buf);
-    sprintf(buf, "%sContent-length: %d\r\n", buf, filesize);
-    sprintf(buf, "%sContent-type: %s\r\n\r\n", buf, filetype);
-    Rio_writen(fd, buf, strlen(buf));
+    sb_init(&sb, c->out, MAXBUF);
+    start_response(c, &sb, "200", "OK");
+    sb_printf(&sb, "Content-length: %d\r\n", filesize);
+    sb_printf(&sb, "Content-type: %s\r\n\r\n", filetype);
     printf("Response headers:\n");
-    printf("%s", buf);
+    printf("%s", sb.buf);
 
-    /* Send response body to client */
-    srcfd = Open(filename, O_RDONLY, 0);
-    srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-    Close(srcfd);
-    Rio_writen(fd, srcp, filesize);
-    Munmap(srcp, filesize);
+    c->out_len = sb.len;
+    c->out_off = 0;
+    c->filefd = srcfd;
+    c->file_off = 0;
+    c->file_end = filesize;
+    /* Hold partial frames so headers and the first of the file share them */
+    if (filesize > 0)
+        set_cork(c, 1);
 }
 
 /*
@@ -185,21 +542,147 @@ void get_filetype(char *filename, char *filetype)
         strcpy(filetype, "text/plain");
 }
 
-void serve_dynamic(int fd, char *filename, char *cgiargs)
+/*
+ * serve_dynamic - start a CGI program with its stdout on a pipe that the
+ *     event loop relays to the client. The output has no length, so the
+ *     connection closes after it.
+ */
+void serve_dynamic(conn_t *c, char *filename, char *cgiargs)
 {
-    char buf[MAXLINE], *emptylist[] = { NULL };
+    char *emptylist[] = { NULL };
+    strbuf_t sb;
+    int pipefd[2];
+    sigset_t mask;
 
-    /* Return first part of HTTP response */
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Server: Tiny Web Server\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    if (ncgi == MAXCGI) {
+        clienterror(c, filename, "503", "Service Unavailable",
+                    "Tiny is running too many CGI programs");
+        return;
+    }
+    if (pipe(pipefd) < 0) {
+        clienterror(c, filename, "500", "Internal Server Error",
+                    "Tiny couldn't start the CGI program");
+        return;
+    }
+    fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(pipefd[1], F_SETFD, FD_CLOEXEC);
+    if (pipefd[0] >= fdtab_size) {
+        Close(pipefd[0]);
+        Close(pipefd[1]);
+        clienterror(c, filename, "503", "Service Unavailable",
+                    "Tiny is out of descriptors");
+        return;
+    }
+
+    /* Queue first part of HTTP response */
+    c->keepalive = 0;
+    sb_init(&sb, c->out, MAXBUF);
+    start_response(c, &sb, "200", "OK");
+    c->out_len = sb.len;
+    c->out_off = 0;
 
     if (Fork() == 0) { /* Child */
         /* Real server would set all CGI vars here */
         setenv("QUERY_STRING", cgiargs, 1);
-        Dup2(fd, STDOUT_FILENO);         /* Redirect stdout to client */
+        Sigemptyset(&mask);
+        Sigaddset(&mask, SIGCHLD);
+        Sigprocmask(SIG_UNBLOCK, &mask, NULL);
+        Signal(SIGPIPE, SIG_DFL);
+        Dup2(pipefd[1], STDOUT_FILENO);  /* Redirect stdout to the pipe */
         Execve(filename, emptylist, environ); /* Run CGI program */
     }
-    Wait(NULL); /* Parent waits for and reaps child */
+    Close(pipefd[1]);
+    fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+
+    ncgi++;
+    c->pipefd = pipefd[0];
+    c->pipe_events = 0;  /* update_events adds it once the headers are out */
+    fdtab[pipefd[0]] = c;
+}
+
+/*
+ * relay_cgi - take the next piece of a CGI program's output; EOF on the
+ *     pipe ends the response
+ */
+void relay_cgi(conn_t *c)
+{
+    ssize_t n;
+
+    if (c->out_len)  /* Reported before update_events dropped the pipe */
+        return;
+    if ((n = read(c->pipefd, c->out, MAXBUF)) > 0) {
+        c->out_len = n;
+        c->out_off = 0;
+    }
+    else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+        fdtab[c->pipefd] = NULL;
+        Close(c->pipefd);  /* Also drops it from the epoll set */
+        c->pipefd = -1;
+        ncgi--;
+    }
+    service(c);
+}
+
+/*
+ * reap_cgis - reap every CGI program that has exited
+ */
+void reap_cgis(int sigfd)
+{
+    struct signalfd_siginfo si;
+    int status;
+
+    while (read(sigfd, &si, sizeof(si)) == sizeof(si))
+        ;
+    /* Signals coalesce, so one read may stand for several children */
+    while (waitpid(-1, &status, WNOHANG) > 0)
+        ;
+}
+
+/*
+ * sb_init - start appending to buf, which holds size bytes
+ */
+void sb_init(strbuf_t *sb, char *buf, int size)
+{
+    sb->buf = buf;
+    sb->len = 0;
+    sb->size = size;
+    buf[0] = '\0';
+}
+
+/*
+ * sb_printf - append formatted text, truncating once the buffer is full
+ */
+void sb_printf(strbuf_t *sb, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(sb->buf + sb->len, sb->size - sb->len, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        sb->len += n < sb->size - sb->len ? n : sb->size - 1 - sb->len;
+}
+
+/*
+ * start_response - append the status line and the headers every
+ *     response carries
+ */
+void start_response(conn_t *c, strbuf_t *sb, char *status, char *reason)
+{
+    sb_printf(sb, "%s %s %s\r\n", c->http11 ? "HTTP/1.1" : "HTTP/1.0",
+              status, reason);
+    sb_printf(sb, "Server: Tiny Web Server\r\n");
+    sb_printf(sb, "Connection: %s\r\n", c->keepalive ? "keep-alive" : "close");
+}
+
+/*
+ * set_cork - hold back partial TCP segments while on
+ */
+void set_cork(conn_t *c, int on)
+{
+    if (c->corked == on)
+        return;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    c->corked = on;
 }